@@ -0,0 +1,440 @@
+/*
+ * BAMIndex.cc
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include "BAMIndex.h"
+#include "BGZF.h"
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+
+namespace
+{
+    void fatalIndexErr( char const* file )
+    {
+        throw std::runtime_error(std::string("Can't write index file ") + file);
+    }
+
+    void fatalIndexReadErr( char const* file, char const* why )
+    {
+        throw std::runtime_error(std::string("Can't read index file ") + file + ": " + why);
+    }
+
+    template <class T>
+    void put( std::vector<char>& buf, T val )
+    {
+        char const* ptr = reinterpret_cast<char const*>(&val);
+        buf.insert(buf.end(),ptr,ptr+sizeof(val));
+    }
+
+    // pulls values out of an index file's contents, in order
+    class IndexReader
+    {
+    public:
+        IndexReader( char const* file, std::vector<char> const& buf )
+        : mFile(file), mItr(buf.data()), mEnd(buf.data()+buf.size()) {}
+
+        template <class T>
+        T get()
+        { T val;
+          if ( size_t(mEnd-mItr) < sizeof(val) )
+              fatalIndexReadErr(mFile,"it's truncated");
+          memcpy(&val,mItr,sizeof(val));
+          mItr += sizeof(val);
+          return val; }
+
+        // a count of things at least minSize bytes in size
+        size_t getCount( size_t minSize )
+        { int32_t val = get<int32_t>();
+          if ( val < 0 || size_t(mEnd-mItr)/minSize < size_t(val) )
+              fatalIndexReadErr(mFile,"it's corrupt");
+          return val; }
+
+        void skip( size_t len )
+        { if ( size_t(mEnd-mItr) < len )
+              fatalIndexReadErr(mFile,"it's truncated");
+          mItr += len; }
+
+    private:
+        char const* mFile;
+        char const* mItr;
+        char const* mEnd;
+    };
+}
+
+int64_t getRefEnd( BAMAlignHead const& aln, char const* rec, uint32_t len )
+{
+    uint32_t const HEAD_LEN = sizeof(aln) - sizeof(aln.mRemainingBlockSize);
+    int64_t refEnd = aln.mPos;
+    char const* cigar = rec + HEAD_LEN + aln.mNameLen;
+    if ( HEAD_LEN + aln.mNameLen + 4ul*aln.mCigarLen <= len )
+    {
+        for ( unsigned idx = 0; idx != aln.mCigarLen; ++idx )
+        {
+            uint32_t op;
+            memcpy(&op,cigar+4*idx,sizeof(op));
+            switch ( op & 0xf )
+            {
+            case 0: case 2: case 3: case 7: case 8: // M, D, N, =, X
+                refEnd += op >> 4;
+                break;
+            }
+        }
+    }
+    if ( refEnd == aln.mPos )
+        refEnd = aln.mPos + 1;
+    return refEnd;
+}
+
+uint64_t const BAMIndexer::NONE;
+
+BAMIndexer::BAMIndexer( std::vector<uint32_t> const& refLens )
+: mRefs(refLens.size()), mNResolved(0), mDepth(BAI_DEPTH), mLastRefID(0), mLastPos(0), mNNoCoor(0),
+  mProblem(0)
+{
+    uint32_t maxLen = refLens.empty() ? 0 : *std::max_element(refLens.begin(),refLens.end());
+    while ( (1ul << (MIN_SHIFT+3*mDepth)) < maxLen )
+        mDepth += 1;
+}
+
+void BAMIndexer::add( char const* rec, uint32_t len, uint64_t beg, uint64_t end )
+{
+    if ( mProblem )
+        return; // EARLY RETURN!
+
+    BAMAlignHead aln;
+    uint32_t const HEAD_LEN = sizeof(aln) - sizeof(aln.mRemainingBlockSize);
+    memcpy(reinterpret_cast<char*>(&aln)+sizeof(aln.mRemainingBlockSize),rec,HEAD_LEN);
+
+    if ( aln.mRefID < 0 )
+    {
+        mLastRefID = mRefs.size();
+        mNNoCoor += 1;
+        return; // EARLY RETURN!
+    }
+    if ( uint32_t(aln.mRefID) >= mRefs.size() )
+    {
+        mProblem = "an alignment has an invalid reference ID";
+        return; // EARLY RETURN!
+    }
+    if ( aln.mRefID < mLastRefID || (aln.mRefID == mLastRefID && aln.mPos < mLastPos) )
+    {
+        mProblem = "the alignments aren't sorted by coordinate";
+        return; // EARLY RETURN!
+    }
+    if ( aln.mPos < 0 )
+    {
+        mProblem = "a placed alignment has no position";
+        return; // EARLY RETURN!
+    }
+    mLastRefID = aln.mRefID;
+    mLastPos = aln.mPos;
+
+    int64_t refBeg = aln.mPos;
+    int64_t refEnd = getRefEnd(aln,rec,len);
+    if ( uint64_t(refEnd) > (1ul << (MIN_SHIFT+3*mDepth)) )
+    {
+        mProblem = "an alignment extends past the end of its reference";
+        return; // EARLY RETURN!
+    }
+
+    RefIndex& ref = mRefs[aln.mRefID];
+    if ( !ref.mNMapped && !ref.mNUnmapped )
+        ref.mBeg = beg;
+    ref.mEnd = end;
+    if ( aln.mFlags & 4 )
+        ref.mNUnmapped += 1;
+    else
+        ref.mNMapped += 1;
+
+    // consecutive alignments in the same bin make a single chunk
+    std::vector<Chunk>& chunks = ref.mBins[reg2bin(refBeg,refEnd)];
+    if ( !chunks.empty() && chunks.back().mEnd == beg )
+        chunks.back().mEnd = end;
+    else
+        chunks.push_back(Chunk(beg,end));
+
+    size_t firstWin = refBeg >> MIN_SHIFT;
+    size_t lastWin = (refEnd - 1) >> MIN_SHIFT;
+    if ( ref.mLinear.size() <= lastWin )
+        ref.mLinear.resize(lastWin+1,NONE);
+    for ( size_t win = firstWin; win <= lastWin; ++win )
+        if ( ref.mLinear[win] == NONE )
+            ref.mLinear[win] = beg;
+}
+
+// the alignments are sorted, so the references before the last one seen are
+// finished
+void BAMIndexer::resolve( BGZFStreambuf& sb )
+{
+    if ( mProblem )
+        return; // EARLY RETURN!
+
+    size_t nResolved = mNResolved;
+    while ( mNResolved < size_t(mLastRefID) && mRefs[mNResolved].mEnd <= sb.getNWritten() )
+        resolve(mRefs[mNResolved++],sb);
+    if ( mNResolved == nResolved )
+        return; // EARLY RETURN!
+
+    uint64_t firstUnresolved = sb.getNWritten();
+    for ( auto itr = mRefs.begin()+mNResolved; itr != mRefs.end(); ++itr )
+        if ( itr->mNMapped || itr->mNUnmapped )
+        {
+            firstUnresolved = itr->mBeg;
+            break;
+        }
+    sb.forgetOffsetsBefore(firstUnresolved);
+}
+
+void BAMIndexer::resolve( RefIndex& ref, BGZFStreambuf const& sb )
+{
+    if ( !ref.mNMapped && !ref.mNUnmapped )
+        return; // EARLY RETURN!
+
+    for ( auto& entry : ref.mBins )
+        for ( Chunk& chunk : entry.second )
+        {
+            chunk.mBeg = sb.virtualOffset(chunk.mBeg);
+            chunk.mEnd = sb.virtualOffset(chunk.mEnd);
+        }
+    for ( uint64_t& offset : ref.mLinear )
+        if ( offset != NONE )
+            offset = sb.virtualOffset(offset);
+    ref.mBeg = sb.virtualOffset(ref.mBeg);
+    ref.mEnd = sb.virtualOffset(ref.mEnd);
+}
+
+void BAMIndexer::writeBAI( char const* file, BGZFStreambuf const& sb ) const
+{
+    write(file,sb,false);
+}
+
+void BAMIndexer::writeCSI( char const* file, BGZFStreambuf const& sb ) const
+{
+    write(file,sb,true);
+}
+
+void BAMIndexer::write( char const* file, BGZFStreambuf const& sb, bool csi ) const
+{
+    std::vector<char> buf;
+    if ( !csi )
+        buf.insert(buf.end(),"BAI\1",&"BAI\1"[4]);
+    else
+    {
+        buf.insert(buf.end(),"CSI\1",&"CSI\1"[4]);
+        put<int32_t>(buf,MIN_SHIFT);
+        put<int32_t>(buf,mDepth);
+        put<int32_t>(buf,0); // no auxiliary data
+    }
+    put<int32_t>(buf,mRefs.size());
+    for ( size_t refID = 0; refID != mRefs.size(); ++refID )
+    {
+        RefIndex const& ref = mRefs[refID];
+        auto vOffset = [&]( uint64_t offset )
+                        { return refID < mNResolved ? offset : sb.virtualOffset(offset); };
+
+        // empty windows of the linear index get the offset of the next
+        // window that isn't empty
+        std::vector<uint64_t> linear(ref.mLinear.size());
+        uint64_t next = 0;
+        for ( size_t win = linear.size(); win-- > 0; )
+        {
+            if ( ref.mLinear[win] != NONE )
+                next = vOffset(ref.mLinear[win]);
+            linear[win] = next;
+        }
+
+        bool hasAlns = ref.mNMapped || ref.mNUnmapped;
+        put<int32_t>(buf,ref.mBins.size()+hasAlns);
+        for ( auto const& entry : ref.mBins )
+        {
+            uint32_t bin = entry.first;
+            put<uint32_t>(buf,bin);
+            if ( csi ) // the linear index's offset for the bin's first window
+            {
+                uint32_t level = binLevel(bin);
+                uint32_t first = ((1u << 3*level) - 1) / 7;
+                size_t win = size_t(bin - first) << 3*(mDepth-level);
+                put<uint64_t>(buf,win < linear.size() ? linear[win] : 0);
+            }
+            put<int32_t>(buf,entry.second.size());
+            for ( Chunk const& chunk : entry.second )
+            {
+                put<uint64_t>(buf,vOffset(chunk.mBeg));
+                put<uint64_t>(buf,vOffset(chunk.mEnd));
+            }
+        }
+        if ( hasAlns ) // the pseudo-bin, with the ref's extent and counts
+        {
+            put<uint32_t>(buf,pseudoBin());
+            if ( csi )
+                put<uint64_t>(buf,0);
+            put<int32_t>(buf,2);
+            put<uint64_t>(buf,vOffset(ref.mBeg));
+            put<uint64_t>(buf,vOffset(ref.mEnd));
+            put<uint64_t>(buf,ref.mNMapped);
+            put<uint64_t>(buf,ref.mNUnmapped);
+        }
+        if ( !csi )
+        {
+            put<int32_t>(buf,linear.size());
+            for ( uint64_t offset : linear )
+                put<uint64_t>(buf,offset);
+        }
+    }
+    put<uint64_t>(buf,mNNoCoor);
+
+    std::ofstream os(file,std::ios_base::out|std::ios_base::binary|std::ios_base::trunc);
+    if ( !os.write(buf.data(),buf.size()) || !os.flush() )
+        fatalIndexErr(file);
+}
+
+// the smallest bin that holds the half-open interval [beg,end)
+uint32_t BAMIndexer::reg2bin( int64_t beg, int64_t end ) const
+{
+    end -= 1;
+    unsigned shift = MIN_SHIFT;
+    uint32_t first = ((1u << 3*mDepth) - 1) / 7;
+    for ( unsigned level = mDepth; level; --level )
+    {
+        if ( beg >> shift == end >> shift )
+            return first + (beg >> shift);
+        shift += 3;
+        first -= 1u << 3*(level-1);
+    }
+    return 0;
+}
+
+BAMIndex::BAMIndex( char const* file )
+: mMinShift(BAMIndexer::MIN_SHIFT), mDepth(BAMIndexer::BAI_DEPTH), mIsCSI(false)
+{
+    std::ifstream is(file,std::ios_base::in|std::ios_base::binary|std::ios_base::ate);
+    std::vector<char> buf(std::max(std::streamoff(is.tellg()),std::streamoff(0)));
+    if ( !is || buf.empty() || !is.seekg(0) || !is.read(buf.data(),buf.size()) )
+        fatalIndexReadErr(file,"it's unreadable");
+
+    IndexReader rdr(file,buf);
+    uint32_t magic = rdr.get<uint32_t>();
+    if ( magic == 0x01495343 ) // CSI\1
+    {
+        mIsCSI = true;
+        int32_t minShift = rdr.get<int32_t>();
+        int32_t depth = rdr.get<int32_t>();
+        if ( minShift < 1 || depth < 0 || depth > 10 || minShift + 3*depth > 62 )
+            fatalIndexReadErr(file,"it's corrupt");
+        mMinShift = minShift;
+        mDepth = depth;
+        rdr.skip(rdr.getCount(1)); // auxiliary data
+    }
+    else if ( magic != 0x01494142 ) // BAI\1
+        fatalIndexReadErr(file,"it's not a BAI or CSI index");
+
+    mRefs.resize(rdr.getCount(4));
+    for ( RefIndex& ref : mRefs )
+    {
+        size_t nBins = rdr.getCount(8);
+        while ( nBins-- )
+        {
+            Bin& bin = ref.mBins[rdr.get<uint32_t>()];
+            if ( mIsCSI )
+                bin.mLOffset = rdr.get<uint64_t>();
+            size_t nChunks = rdr.getCount(16);
+            while ( nChunks-- )
+            {
+                uint64_t beg = rdr.get<uint64_t>();
+                bin.mChunks.push_back(Chunk(beg,rdr.get<uint64_t>()));
+            }
+        }
+        if ( !mIsCSI )
+        {
+            ref.mLinear.resize(rdr.getCount(8));
+            for ( uint64_t& offset : ref.mLinear )
+                offset = rdr.get<uint64_t>();
+        }
+    }
+    // n_no_coor may follow, but we don't need it
+}
+
+std::vector<BAMIndex::Chunk> BAMIndex::getChunks( int32_t refID, int64_t beg,
+                                                    int64_t end ) const
+{
+    std::vector<Chunk> chunks;
+    int64_t maxEnd = int64_t(1) << (mMinShift+3*mDepth);
+    beg = std::max(beg,int64_t(0));
+    end = std::min(end,maxEnd);
+    if ( refID < 0 || size_t(refID) >= mRefs.size() || beg >= end )
+        return chunks; // EARLY RETURN!
+    RefIndex const& ref = mRefs[refID];
+
+    // no alignment overlapping the interval can start before this
+    uint64_t minOffset = 0;
+    uint32_t first = ((1u << 3*mDepth) - 1) / 7;
+    if ( !mIsCSI )
+    {
+        size_t win = beg >> mMinShift;
+        if ( !ref.mLinear.empty() )
+            minOffset = ref.mLinear[std::min(win,ref.mLinear.size()-1)];
+    }
+    else
+    {
+        // the loffset of the smallest bin in the index holding beg
+        for ( uint32_t bin = first + (beg >> mMinShift); ; bin = (bin - 1) >> 3 )
+        {
+            auto itr = ref.mBins.find(bin);
+            if ( itr != ref.mBins.end() )
+            {
+                minOffset = itr->second.mLOffset;
+                break;
+            }
+            if ( !bin )
+                break;
+        }
+    }
+
+    // the chunks of every bin that overlaps the interval, at every level
+    end -= 1;
+    unsigned shift = mMinShift + 3*mDepth;
+    first = 0;
+    for ( unsigned level = 0; level <= mDepth; ++level )
+    {
+        auto itr = ref.mBins.lower_bound(first + (beg >> shift));
+        auto stop = ref.mBins.upper_bound(first + (end >> shift));
+        for ( ; itr != stop; ++itr )
+            for ( Chunk const& chunk : itr->second.mChunks )
+                if ( chunk.mEnd > minOffset )
+                    chunks.push_back(chunk);
+        first += 1u << 3*level;
+        shift -= 3;
+    }
+
+    std::sort(chunks.begin(),chunks.end(),
+              []( Chunk const& c1, Chunk const& c2 ) { return c1.mBeg < c2.mBeg; });
+    auto out = chunks.begin();
+    for ( auto itr = chunks.begin(); itr != chunks.end(); ++itr )
+    {
+        if ( out != chunks.begin() && itr->mBeg <= out[-1].mEnd )
+            out[-1].mEnd = std::max(out[-1].mEnd,itr->mEnd);
+        else
+            *out++ = *itr;
+    }
+    chunks.erase(out,chunks.end());
+    return chunks;
+}
+
+bool BAMIndex::getCounts( int32_t refID, uint64_t& nMapped, uint64_t& nUnmapped ) const
+{
+    if ( refID < 0 || size_t(refID) >= mRefs.size() )
+        return false; // EARLY RETURN!
+    uint32_t pseudoBin = ((1u << 3*(mDepth+1)) - 1) / 7 + 1;
+    auto itr = mRefs[refID].mBins.find(pseudoBin);
+    if ( itr == mRefs[refID].mBins.end() || itr->second.mChunks.size() != 2 )
+        return false; // EARLY RETURN!
+    nMapped = itr->second.mChunks[1].mBeg;
+    nUnmapped = itr->second.mChunks[1].mEnd;
+    return true;
+}
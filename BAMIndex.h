@@ -0,0 +1,137 @@
+/*
+ * BAMIndex.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef BAMINDEX_H_
+#define BAMINDEX_H_
+
+#include <map>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+class BGZFStreambuf;
+struct BAMAlignHead;
+
+// the end, on the reference, of the alignment whose data (just past its block
+// size) is rec, from its cigar.  an alignment that covers no reference bases
+// (say, because it has no cigar) is treated as covering the one at its pos.
+int64_t getRefEnd( BAMAlignHead const& aln, char const* rec, uint32_t len );
+
+// builds a BAI or CSI index for a coordinate-sorted BAM as it's written.
+// alignments are noted by their offsets in the uncompressed data, and those
+// are translated into virtual offsets once they've been written out:  a
+// reference's as soon as the alignments have moved past it, the rest when the
+// index is written, after the BAM has been flushed.
+class BAMIndexer
+{
+public:
+    // refLens are the reference sequence lengths from the BAM's header
+    explicit BAMIndexer( std::vector<uint32_t> const& refLens );
+    BAMIndexer( BAMIndexer const& )=delete;
+    BAMIndexer& operator=( BAMIndexer const& )=delete;
+
+    // notes the alignment whose data (just past its block size) is rec, and
+    // which occupies the uncompressed data from beg up to end.  if it can't be
+    // indexed (say, because it's out of order) the rest are ignored, too, and
+    // getProblem says why.
+    void add( char const* rec, uint32_t len, uint64_t beg, uint64_t end );
+
+    // translates the offsets of the finished references whose alignments sb
+    // has written out, and tells sb to forget the blocks before the rest
+    void resolve( BGZFStreambuf& sb );
+
+    char const* getProblem() const { return mProblem; }
+
+    // false if some reference is too long for a BAI
+    bool canWriteBAI() const { return mDepth == BAI_DEPTH; }
+
+    // these throw std::runtime_error if the file can't be written
+    void writeBAI( char const* file, BGZFStreambuf const& sb ) const;
+    void writeCSI( char const* file, BGZFStreambuf const& sb ) const;
+
+    static unsigned const MIN_SHIFT = 14; // 16Kb linear index windows
+    static unsigned const BAI_DEPTH = 5;
+
+private:
+    struct Chunk
+    { Chunk( uint64_t beg, uint64_t end ) : mBeg(beg), mEnd(end) {}
+      uint64_t mBeg; uint64_t mEnd; };
+
+    struct RefIndex
+    {
+        RefIndex() : mBeg(0), mEnd(0), mNMapped(0), mNUnmapped(0) {}
+        std::map<uint32_t,std::vector<Chunk>> mBins;
+        std::vector<uint64_t> mLinear; // first offset in each window, or NONE
+        uint64_t mBeg;
+        uint64_t mEnd;
+        uint64_t mNMapped;
+        uint64_t mNUnmapped;
+    };
+
+    void write( char const* file, BGZFStreambuf const& sb, bool csi ) const;
+    static void resolve( RefIndex& ref, BGZFStreambuf const& sb );
+
+    uint32_t reg2bin( int64_t beg, int64_t end ) const;
+    uint32_t pseudoBin() const { return ((1u << 3*(mDepth+1)) - 1) / 7 + 1; }
+
+    static uint64_t const NONE = ~0ul;
+
+    static uint32_t binLevel( uint32_t bin )
+    { uint32_t level = 0;
+      for ( uint32_t first = 0; bin >= first + (1u << 3*level); ++level )
+          first += 1u << 3*level;
+      return level; }
+
+    std::vector<RefIndex> mRefs;
+    size_t mNResolved; // refs before this one have virtual offsets
+    unsigned mDepth;
+    int32_t mLastRefID;
+    int64_t mLastPos;
+    uint64_t mNNoCoor;
+    char const* mProblem;
+};
+
+// a BAI or CSI index, read from a file, for finding the alignments that
+// overlap a region without reading the whole BAM
+class BAMIndex
+{
+public:
+    // throws std::runtime_error if the file can't be read
+    explicit BAMIndex( char const* file );
+    BAMIndex( BAMIndex const& )=delete;
+    BAMIndex& operator=( BAMIndex const& )=delete;
+
+    // a range of virtual offsets in the BAM
+    struct Chunk
+    { Chunk( uint64_t beg, uint64_t end ) : mBeg(beg), mEnd(end) {}
+      uint64_t mBeg; uint64_t mEnd; };
+
+    // the chunks that might hold alignments overlapping the zero-based,
+    // half-open interval [beg,end) of reference refID, in file order, and
+    // merged where they overlap or abut
+    std::vector<Chunk> getChunks( int32_t refID, int64_t beg, int64_t end ) const;
+
+    // the numbers of mapped and unmapped alignments placed on reference refID,
+    // from its pseudo-bin.  returns false if it hasn't one.
+    bool getCounts( int32_t refID, uint64_t& nMapped, uint64_t& nUnmapped ) const;
+
+private:
+    struct Bin
+    { Bin() : mLOffset(0) {}
+      uint64_t mLOffset; // CSI only
+      std::vector<Chunk> mChunks; };
+
+    struct RefIndex
+    { std::map<uint32_t,Bin> mBins;
+      std::vector<uint64_t> mLinear; }; // BAI only
+
+    std::vector<RefIndex> mRefs;
+    unsigned mMinShift;
+    unsigned mDepth;
+    bool mIsCSI;
+};
+
+#endif /* BAMINDEX_H_ */
@@ -11,111 +11,623 @@
  * \author tsharpe
  * \date May 21, 2009
  *
- * \brief Utilities for writing BAM files.
+ * \brief Utilities for reading and writing BAM files.
  */
 #include "BGZF.h"
-#include <zlib.h>
-#include <iostream>
+#include "Stats.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace
 {
-    void fatalErr( char const* msg )
+    void fatalErr( std::string const& msg )
     {
-        std::cerr << "Can't write BAM file: " << msg << std::endl;
-        exit(1);
+        throw std::runtime_error("Can't write BAM file: " + msg);
     }
-}
-
-unsigned int BGZFBlock::compress( void* data, unsigned int len )
-{
-    while ( !tryCompress(data,len) )
-        ;
-    return len;
-}
-
-bool BGZFBlock::tryCompress( void* data, unsigned int& len )
-{
-    z_stream zs;
-    zs.zalloc = 0;
-    zs.zfree = 0;
-    zs.opaque = 0;
-    if ( deflateInit2(&zs,Z_DEFAULT_COMPRESSION,Z_DEFLATED,WINDOW_BITS,MEM_LEVEL,Z_DEFAULT_STRATEGY) != Z_OK )
-        fatalErr("Can't initialize BAM file's z_stream.");
 
-    zs.next_in = reinterpret_cast<Bytef*>(data);
-    zs.avail_in = len;
-    zs.next_out = mDataBlock;
-    zs.avail_out = sizeof(mDataBlock);
-    if ( deflate(&zs,Z_FINISH) != Z_STREAM_END )
+    void fatalReadErr( std::string const& msg )
     {
-        zs.avail_in += 256;
-        if ( zs.avail_in >= len )
-            fatalErr("Can't deflate even a tiny amount of data for BAM file.");
-        len -= zs.avail_in; // back off by the amount we were unable to compress, and a little more
-        return false;
+        throw std::runtime_error("Can't read BAM file: " + msg);
     }
 
-    if ( deflateEnd(&zs) != Z_OK )
-        fatalErr("Can't finalize BAM file's z_stream.");
+    // the parts of a gzip header that precede the extra subfields
+    size_t const GZIP_PREFIX_LEN = 12;
+    // the CRC32 and ISIZE that follow the compressed data
+    size_t const GZIP_SUFFIX_LEN = 8;
+}
 
-    unsigned char* ppp = mDataBlock + zs.total_out;
-    unsigned int crc = crc32(crc32(0,0,0),reinterpret_cast<Bytef*>(data),len);
+void BGZFBlock::finish( void const* data, unsigned int len, unsigned int compressedLen )
+{
+    unsigned char* ppp = mDataBlock + compressedLen;
+    unsigned int crc = crc32(crc32(0,0,0),reinterpret_cast<Bytef const*>(data),len);
     memcpy(ppp,&crc,sizeof(unsigned int)); // setting mCRC32
     ppp += sizeof(unsigned int);
     memcpy(ppp,&len,sizeof(unsigned int)); // setting mInputSize
     ppp += sizeof(unsigned int);
     mBlockSizeLessOne = (ppp - reinterpret_cast<unsigned char*>(this)) - 1U;
+}
 
-    return true;
+BGZFCompressor::BGZFCompressor( int level, int strategy )
+: mLevel(level)
+{
+    if ( !mLevel )
+        return; // EARLY RETURN!  we'll never call zlib.
+
+    mZS.zalloc = 0;
+    mZS.zfree = 0;
+    mZS.opaque = 0;
+    if ( deflateInit2(&mZS,level,Z_DEFLATED,WINDOW_BITS,MEM_LEVEL,strategy) != Z_OK )
+        fatalErr("Can't initialize BAM file's z_stream.");
+    if ( deflateBound(&mZS,BGZFBlock::MAX_INPUT_SIZE) > sizeof(BGZFBlock::mDataBlock) )
+        fatalErr("BGZF block too small for deflate's worst case.");
 }
 
-BGZFStreambuf::int_type BGZFStreambuf::overflow( int_type ch )
+BGZFCompressor::~BGZFCompressor()
 {
-    if ( ch != traits_type::eof() )
+    if ( mLevel )
+        deflateEnd(&mZS);
+}
+
+void BGZFCompressor::compress( void const* data, unsigned int len, BGZFBlock& block )
+{
+    if ( len > BGZFBlock::MAX_INPUT_SIZE )
+        fatalErr("Too much data for one BGZF block.");
+    Stats::Timer timer(Stats::DEFLATE);
+
+    if ( !mLevel )
     {
-        *pptr() = ch;
-        pbump(1);
+        store(data,len,block);
+        return; // EARLY RETURN!
     }
 
-    char* ppp = pptr();
-    unsigned int inLen = ppp - mBuf;
-    if ( !inLen )
-        return 0; // EARLY RETURN!
+    if ( deflateReset(&mZS) != Z_OK )
+        fatalErr("Can't reset BAM file's z_stream.");
+    mZS.next_in = const_cast<Bytef*>(reinterpret_cast<Bytef const*>(data));
+    mZS.avail_in = len;
+    mZS.next_out = block.mDataBlock;
+    mZS.avail_out = sizeof(block.mDataBlock);
+    if ( deflate(&mZS,Z_FINISH) != Z_STREAM_END )
+    {
+        store(data,len,block); // can't happen, given deflateBound, but cheap insurance
+        Stats::count(Stats::STORED_FALLBACKS,1);
+    }
+    else
+        block.finish(data,len,mZS.total_out);
+}
 
-    setp(mBuf,epptr());
+void BGZFCompressor::store( void const* data, unsigned int len, BGZFBlock& block )
+{
+    unsigned char* ppp = block.mDataBlock;
+    *ppp++ = 1; // BFINAL=1, BTYPE=00
+    unsigned short nLen = len;
+    memcpy(ppp,&nLen,sizeof(nLen));
+    ppp += sizeof(nLen);
+    nLen = ~nLen;
+    memcpy(ppp,&nLen,sizeof(nLen));
+    ppp += sizeof(nLen);
+    memcpy(ppp,data,len);
+    ppp += len;
+    block.finish(data,len,ppp-block.mDataBlock);
+}
 
-    BGZFBlock output;
-    inLen -= output.compress(mBuf,inLen);
-    if ( inLen )
+// called with a character when the buffer's full, and with eof to flush it
+BGZFStreambuf::int_type BGZFStreambuf::overflow( int_type ch )
+{
+    unsigned int inLen = pptr() - mBuf;
+    if ( ch == traits_type::eof() )
     {
-        memmove(mBuf,ppp-inLen,inLen);
-        pbump(inLen);
+        if ( inLen )
+            emit(inLen);
+        return 0; // EARLY RETURN!
     }
 
-    if ( mpSB->sputn(reinterpret_cast<char const*>(&output),output.getBlockSize()) != output.getBlockSize() )
-        fatalErr("Can't write to BAM file.");
-
+    *pptr() = ch;
+    pbump(1);
+    emit(mRecordAligned && mLastBoundary ? mLastBoundary : inLen + 1);
     return 0;
 }
 
+void BGZFStreambuf::emit( unsigned len )
+{
+    mNSubmitted += len;
+    if ( mpPool )
+        submit(len);
+    else
+    {
+        mCompressor.compress(mBuf,len,mBlock);
+        write(mBlock,len);
+    }
+
+    unsigned rest = pptr() - mBuf - len;
+    memmove(mBuf,mBuf+len,rest);
+    setp(mBuf,epptr());
+    pbump(rest);
+    mLastBoundary = 0;
+}
+
 int BGZFStreambuf::sync()
 {
     while ( pptr() != pbase() )
         overflow( traits_type::eof() );
+    while ( !mPending.empty() )
+        writeJob();
     return 0;
 }
 
-BAMostream::BAMostream( char const* bamFile )
-: std::ostream(&mSB), mSB(&mFilebuf)
+void BGZFStreambuf::submit( unsigned len )
+{
+    std::unique_ptr<Job> pJob;
+    if ( mIdle.empty() )
+        pJob.reset(new Job(mLevel,mStrategy));
+    else
+    {
+        pJob = std::move(mIdle.back());
+        mIdle.pop_back();
+    }
+    pJob->mData.assign(mBuf,mBuf+len);
+    Job* pJ = pJob.get();
+    pJob->mDone = mpPool->submit([pJ]{ pJ->compress(); });
+    mPending.push_back(std::move(pJob));
+
+    // write whatever's finished, but don't let too much work pile up
+    size_t maxPending = 2*mpPool->size() + 1;
+    while ( !mPending.empty() &&
+            (mPending.size() > maxPending ||
+             mPending.front()->mDone.wait_for(std::chrono::seconds(0)) == std::future_status::ready) )
+        writeJob();
+}
+
+void BGZFStreambuf::writeJob()
+{
+    std::unique_ptr<Job> pJob = std::move(mPending.front());
+    mPending.pop_front();
+    pJob->mDone.get();
+    write(pJob->mBlock,pJob->mData.size());
+    mIdle.push_back(std::move(pJob));
+}
+
+// writes a block that holds len bytes of uncompressed data
+void BGZFStreambuf::write( char const* block, unsigned blockSize, unsigned len )
+{
+    Stats::Timer timer(Stats::WRITE);
+    if ( mpSB->sputn(block,blockSize) != std::streamsize(blockSize) )
+        fatalErr("Can't write to BAM file.");
+    if ( mTrackOffsets )
+    {
+        mBlockStarts.push_back(mNWritten);
+        mBlockAddrs.push_back(mNCompressedWritten);
+    }
+    mNWritten += len;
+    mNCompressedWritten += blockSize;
+    Stats::count(Stats::BLOCKS_WRITTEN,1);
+    Stats::count(Stats::BYTES_WRITTEN,blockSize);
+}
+
+// the only seeking we support is asking where we are in the uncompressed data
+BGZFStreambuf::pos_type BGZFStreambuf::seekoff( off_type off, std::ios_base::seekdir dir,
+                                                    std::ios_base::openmode which )
+{
+    if ( off || dir != std::ios_base::cur || !(which & std::ios_base::out) )
+        return pos_type(off_type(-1));
+    return pos_type(off_type(mNSubmitted + (pptr() - pbase())));
+}
+
+uint64_t BGZFStreambuf::virtualOffset( uint64_t offset ) const
+{
+    if ( offset > mNWritten )
+        fatalErr("Virtual offset requested for data that hasn't been written.");
+    if ( offset == mNWritten ) // the very end
+        return mNCompressedWritten << 16;
+    if ( mBlockStarts.empty() || offset < mBlockStarts.front() )
+        fatalErr("Virtual offset requested for data whose blocks weren't tracked.");
+    auto itr = std::upper_bound(mBlockStarts.begin(),mBlockStarts.end(),offset) - 1;
+    return mBlockAddrs[itr-mBlockStarts.begin()] << 16 | (offset - *itr);
+}
+
+void BGZFStreambuf::forgetOffsetsBefore( uint64_t offset )
+{
+    auto itr = std::upper_bound(mBlockStarts.begin(),mBlockStarts.end(),offset);
+    if ( itr == mBlockStarts.begin() )
+        return; // EARLY RETURN!
+    size_t nForgotten = itr - mBlockStarts.begin() - 1;
+    mBlockStarts.erase(mBlockStarts.begin(),mBlockStarts.begin()+nForgotten);
+    mBlockAddrs.erase(mBlockAddrs.begin(),mBlockAddrs.begin()+nForgotten);
+}
+
+// an error writing what's left is dropped:  it's being destroyed because of
+// some other error, or close would have written it all.  either way, the pool
+// mustn't be left compressing into jobs that are gone.
+BGZFStreambuf::~BGZFStreambuf()
+{
+    try
+    {
+        sync();
+    }
+    catch ( std::exception const& )
+    {
+        for ( std::unique_ptr<Job>& pJob : mPending )
+            if ( pJob->mDone.valid() )
+                pJob->mDone.wait();
+    }
+}
+
+void BGZFStreambuf::writeEOF()
+{
+    static unsigned char const EOF_BLOCK[] =
+    { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0,
+      3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    sync();
+    Stats::Timer timer(Stats::WRITE);
+    std::streamsize blockSize = sizeof(EOF_BLOCK);
+    if ( mpSB->sputn(reinterpret_cast<char const*>(EOF_BLOCK),blockSize) != blockSize )
+        fatalErr("Can't write to BAM file.");
+    Stats::count(Stats::BLOCKS_WRITTEN,1);
+    Stats::count(Stats::BYTES_WRITTEN,blockSize);
+}
+
+void BGZFStreambuf::copyBlock( char const* block, unsigned blockSize, unsigned len )
+{
+    sync();
+    mNSubmitted += len;
+    write(block,blockSize,len);
+    Stats::count(Stats::BLOCKS_COPIED,1);
+}
+
+BAMostream::BAMostream( char const* bamFile, ThreadPool* pPool, int level, int strategy )
+: std::ostream(&mSB), mSB(&mFilebuf,pPool,level,strategy)
 {
-    mFilebuf.open(bamFile,std::ios_base::out|std::ios_base::binary|std::ios_base::trunc);
+    if ( !strcmp(bamFile,"-") )
+        mFilebuf.attach(STDOUT_FILENO);
+    else if ( !mFilebuf.open(bamFile) )
+        fatalErr(std::string("Can't create ") + bamFile + '.');
+    exceptions(std::ios_base::badbit);
 }
 
 void BAMostream::close()
 {
-    mSB.pubsync();
-    mFilebuf.pubsync();
-    mFilebuf.close();
+    mSB.writeEOF();
+    if ( !mFilebuf.close() )
+        fatalErr("Can't write to BAM file.");
+}
+
+BGZFInStreambuf::Job::Job()
+: mAddr(0), mpBlock(0), mBlockSize(0), mpData(0), mDataSize(0)
+{
+    mZS.zalloc = 0;
+    mZS.zfree = 0;
+    mZS.opaque = 0;
+    mZS.next_in = 0;
+    mZS.avail_in = 0;
+    if ( inflateInit2(&mZS,-15) != Z_OK )
+        fatalReadErr("Can't initialize z_stream.");
+}
+
+BGZFInStreambuf::Job::~Job()
+{
+    inflateEnd(&mZS);
+}
+
+void BGZFInStreambuf::Job::inflate()
+{
+    unsigned char const* beg = reinterpret_cast<unsigned char const*>(mpBlock);
+    unsigned char const* end = beg + mBlockSize;
+    unsigned int crc;
+    unsigned int len;
+    memcpy(&crc,end-GZIP_SUFFIX_LEN,sizeof(crc));
+    memcpy(&len,end-sizeof(len),sizeof(len));
+    // a corrupt trailer mustn't make us allocate gigabytes
+    if ( len > 65536 )
+        fatalReadErr("Block's data size is too big.");
+    mDataSize = len;
+    if ( !len )
+        return; // EARLY RETURN!
+    Stats::Timer timer(Stats::INFLATE);
+
+    unsigned short xLen;
+    memcpy(&xLen,beg+GZIP_PREFIX_LEN-sizeof(xLen),sizeof(xLen));
+    beg += GZIP_PREFIX_LEN + xLen;
+    end -= GZIP_SUFFIX_LEN;
+
+    // a single, final, stored deflate block (as written at level 0) holds the
+    // data as is, after a 5-byte header:  a byte of flags, then LEN and ~LEN.
+    // it's used right where it is, and the get area never writes to it.
+    unsigned short storedLen, storedNLen;
+    if ( end - beg == 5 + len && (beg[0] & 0x07) == 1 &&
+            (memcpy(&storedLen,beg+1,2), memcpy(&storedNLen,beg+3,2), storedLen == len) &&
+            storedNLen == static_cast<unsigned short>(~storedLen) )
+        mpData = const_cast<char*>(reinterpret_cast<char const*>(beg+5));
+    else
+    {
+        mData.resize(len);
+        mpData = &mData[0];
+        if ( inflateReset(&mZS) != Z_OK )
+            fatalReadErr("Can't reset z_stream.");
+        mZS.next_in = const_cast<Bytef*>(beg);
+        mZS.avail_in = end - beg;
+        mZS.next_out = reinterpret_cast<Bytef*>(mpData);
+        mZS.avail_out = len;
+        if ( ::inflate(&mZS,Z_FINISH) != Z_STREAM_END || mZS.avail_out )
+            fatalReadErr("Can't inflate block.");
+    }
+    if ( crc32(crc32(0,0,0),reinterpret_cast<Bytef*>(mpData),len) != crc )
+        fatalReadErr("Block has a bad CRC.");
+}
+
+BGZFInStreambuf::~BGZFInStreambuf()
+{
+    for ( std::unique_ptr<Job>& pJob : mPending )
+        if ( pJob->mDone.valid() )
+            pJob->mDone.wait();
+}
+
+// reads the next compressed block into job.mBlock.  returns false at end of file.
+bool BGZFInStreambuf::readBlock( Job& job )
+{
+    if ( mpMapBeg )
+        return readMappedBlock(job); // EARLY RETURN!
+    Stats::Timer timer(Stats::READ);
+    job.mAddr = mNextAddr;
+    job.mBlock.resize(GZIP_PREFIX_LEN);
+    std::streamsize nRead = mpSB->sgetn(&job.mBlock[0],GZIP_PREFIX_LEN);
+    if ( !nRead )
+        return false; // EARLY RETURN!
+    unsigned char const* hdr = reinterpret_cast<unsigned char const*>(&job.mBlock[0]);
+    if ( nRead != std::streamsize(GZIP_PREFIX_LEN) ||
+            hdr[0] != 31 || hdr[1] != 139 || hdr[2] != 8 || !(hdr[3] & 4) )
+        fatalReadErr("Not in BGZF format.");
+
+    unsigned short xLen;
+    memcpy(&xLen,hdr+GZIP_PREFIX_LEN-sizeof(xLen),sizeof(xLen));
+    job.mBlock.resize(GZIP_PREFIX_LEN+xLen);
+    if ( mpSB->sgetn(&job.mBlock[GZIP_PREFIX_LEN],xLen) != xLen )
+        fatalReadErr("Truncated gzip header.");
+
+    // find the BC subfield, which holds the total block size less one
+    unsigned int blockSize = 0;
+    unsigned char const* xtra = reinterpret_cast<unsigned char const*>(&job.mBlock[GZIP_PREFIX_LEN]);
+    unsigned char const* xend = xtra + xLen;
+    while ( xend - xtra >= 4 )
+    {
+        unsigned short subLen;
+        memcpy(&subLen,xtra+2,sizeof(subLen));
+        if ( xtra[0] == 'B' && xtra[1] == 'C' && subLen == 2 && xend - xtra >= 6 )
+        {
+            unsigned short sizeLessOne;
+            memcpy(&sizeLessOne,xtra+4,sizeof(sizeLessOne));
+            blockSize = sizeLessOne + 1U;
+        }
+        xtra += 4 + subLen;
+    }
+    size_t hdrLen = GZIP_PREFIX_LEN + xLen;
+    if ( blockSize < hdrLen + GZIP_SUFFIX_LEN )
+        fatalReadErr("Not in BGZF format.");
+
+    job.mBlock.resize(blockSize);
+    std::streamsize remaining = blockSize - hdrLen;
+    if ( mpSB->sgetn(&job.mBlock[hdrLen],remaining) != remaining )
+        fatalReadErr("Truncated block.");
+    mNextAddr += blockSize;
+    job.mpBlock = &job.mBlock[0];
+    job.mBlockSize = blockSize;
+    Stats::count(Stats::BLOCKS_READ,1);
+    Stats::count(Stats::BYTES_READ,blockSize);
+    return true;
+}
+
+// points job at the next block in the mapping.  returns false at end of file.
+bool BGZFInStreambuf::readMappedBlock( Job& job )
+{
+    size_t avail = mpMapEnd - mpMapBeg - std::min(mNextAddr,uint64_t(mpMapEnd-mpMapBeg));
+    if ( !avail )
+        return false; // EARLY RETURN!
+    unsigned char const* hdr = reinterpret_cast<unsigned char const*>(mpMapBeg + mNextAddr);
+    if ( avail < GZIP_PREFIX_LEN || hdr[0] != 31 || hdr[1] != 139 || hdr[2] != 8 || !(hdr[3] & 4) )
+        fatalReadErr("Not in BGZF format.");
+
+    unsigned short xLen;
+    memcpy(&xLen,hdr+GZIP_PREFIX_LEN-sizeof(xLen),sizeof(xLen));
+    if ( avail < GZIP_PREFIX_LEN + xLen )
+        fatalReadErr("Truncated gzip header.");
+    unsigned int blockSize = 0;
+    unsigned char const* xtra = hdr + GZIP_PREFIX_LEN;
+    unsigned char const* xend = xtra + xLen;
+    while ( xend - xtra >= 4 )
+    {
+        unsigned short subLen;
+        memcpy(&subLen,xtra+2,sizeof(subLen));
+        if ( xtra[0] == 'B' && xtra[1] == 'C' && subLen == 2 && xend - xtra >= 6 )
+        {
+            unsigned short sizeLessOne;
+            memcpy(&sizeLessOne,xtra+4,sizeof(sizeLessOne));
+            blockSize = sizeLessOne + 1U;
+        }
+        xtra += 4 + subLen;
+    }
+    if ( blockSize < GZIP_PREFIX_LEN + xLen + GZIP_SUFFIX_LEN )
+        fatalReadErr("Not in BGZF format.");
+    if ( avail < blockSize )
+        fatalReadErr("Truncated block.");
+
+    // the pool's workers fault the mapping in as they inflate, so get the
+    // kernel to read it ahead of them
+    if ( mNextAddr >= mWillNeedAddr )
+    {
+        static uint64_t const READ_AHEAD = 8ul << 20;
+        uint64_t beg = mNextAddr & ~uint64_t(sysconf(_SC_PAGESIZE)-1);
+        uint64_t end = std::min(mNextAddr+READ_AHEAD,uint64_t(mpMapEnd-mpMapBeg));
+        madvise(const_cast<char*>(mpMapBeg+beg),end-beg,MADV_WILLNEED);
+        mWillNeedAddr = mNextAddr + READ_AHEAD/2;
+    }
+
+    job.mAddr = mNextAddr;
+    job.mpBlock = reinterpret_cast<char const*>(hdr);
+    job.mBlockSize = blockSize;
+    mNextAddr += blockSize;
+    Stats::count(Stats::BLOCKS_READ,1);
+    Stats::count(Stats::BYTES_READ,blockSize);
+    return true;
+}
+
+void BGZFInStreambuf::readAhead()
+{
+    size_t maxPending = mpPool ? 2*mpPool->size() + 1 : 1;
+    while ( !mAtEOF && mPending.size() < maxPending )
+    {
+        std::unique_ptr<Job> pJob;
+        if ( mIdle.empty() )
+            pJob.reset(new Job);
+        else
+        {
+            pJob = std::move(mIdle.back());
+            mIdle.pop_back();
+        }
+        if ( !readBlock(*pJob) )
+        {
+            mAtEOF = true;
+            mIdle.push_back(std::move(pJob));
+            break;
+        }
+        if ( !mpPool )
+            pJob->inflate();
+        else
+        {
+            Job* pJ = pJob.get();
+            pJob->mDone = mpPool->submit([pJ]{ pJ->inflate(); });
+        }
+        mPending.push_back(std::move(pJob));
+    }
+}
+
+BGZFInStreambuf::int_type BGZFInStreambuf::underflow()
+{
+    if ( gptr() < egptr() )
+        return traits_type::to_int_type(*gptr());
+
+    if ( mpCurrent )
+        mIdle.push_back(std::move(mpCurrent));
+
+    while ( true )
+    {
+        readAhead();
+        if ( mPending.empty() )
+            return traits_type::eof(); // EARLY RETURN!
+        mpCurrent = std::move(mPending.front());
+        mPending.pop_front();
+        if ( mpCurrent->mDone.valid() )
+            mpCurrent->mDone.get();
+        if ( mpCurrent->mDataSize )
+            break;
+        mIdle.push_back(std::move(mpCurrent)); // skip empty blocks, such as the EOF marker
+    }
+
+    char* beg = mpCurrent->mpData;
+    setg(beg,beg,beg+mpCurrent->mDataSize);
+    return traits_type::to_int_type(*beg);
+}
+
+bool BGZFInStreambuf::atBlockStart( Block& block )
+{
+    if ( gptr() == egptr() && underflow() == traits_type::eof() )
+        return false; // EARLY RETURN!
+    if ( gptr() != eback() )
+        return false; // EARLY RETURN!
+    Job const& job = *mpCurrent;
+    block.mAddr = job.mAddr;
+    block.mpBlock = job.mpBlock;
+    block.mBlockSize = job.mBlockSize;
+    block.mpData = job.mpData;
+    block.mDataSize = job.mDataSize;
+    return true;
+}
+
+uint64_t BGZFInStreambuf::virtualTell()
+{
+    // at the end of a block, the next byte is at the start of the next one
+    if ( gptr() == egptr() && underflow() == traits_type::eof() )
+        return mNextAddr << 16; // EARLY RETURN!
+    return mpCurrent->mAddr << 16 | (gptr() - eback());
+}
+
+bool BGZFInStreambuf::virtualSeek( uint64_t offset )
+{
+    for ( std::unique_ptr<Job>& pJob : mPending )
+    {
+        if ( pJob->mDone.valid() )
+            pJob->mDone.get();
+        mIdle.push_back(std::move(pJob));
+    }
+    mPending.clear();
+    if ( mpCurrent )
+        mIdle.push_back(std::move(mpCurrent));
+    setg(0,0,0);
+
+    std::streampos addr(offset >> 16);
+    if ( mpMapBeg ? uint64_t(addr) > uint64_t(mpMapEnd-mpMapBeg) :
+                    mpSB->pubseekpos(addr,std::ios_base::in) != addr )
+        return false; // EARLY RETURN!
+    mNextAddr = offset >> 16;
+    mWillNeedAddr = 0;
+    mAtEOF = false;
+
+    size_t within = offset & 0xffff;
+    if ( underflow() == traits_type::eof() )
+        return !within; // EARLY RETURN!
+    if ( within && (mpCurrent->mAddr != offset >> 16 || within > mpCurrent->mDataSize) )
+        return false; // EARLY RETURN!
+    gbump(within);
+    return true;
+}
+
+MappedFile::MappedFile( char const* file )
+: mpData(0), mSize(0)
+{
+    bool isStdin = !strcmp(file,"-");
+    int fd = isStdin ? dup(STDIN_FILENO) : open(file,O_RDONLY);
+    if ( fd == -1 )
+        return; // EARLY RETURN!
+    // standard input has to be at the start of the file for the mapping to
+    // match what reading it would give
+    struct stat sb;
+    if ( !fstat(fd,&sb) && S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+            (!isStdin || !lseek(fd,0,SEEK_CUR)) )
+    {
+        void* addr = mmap(0,sb.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if ( addr != MAP_FAILED )
+        {
+            // these are only hints, so it doesn't matter if they're refused
+            madvise(addr,sb.st_size,MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+            madvise(addr,sb.st_size,MADV_HUGEPAGE);
+#endif
+            mpData = static_cast<char const*>(addr);
+            mSize = sb.st_size;
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if ( mpData )
+        munmap(const_cast<char*>(mpData),mSize);
+}
+
+BAMistream::BAMistream( char const* bamFile, ThreadPool* pPool )
+: std::istream(&mSB), mMap(bamFile), mSB(&mFilebuf,pPool)
+{
+    if ( mMap.isMapped() )
+        mSB.useMapping(mMap.begin(),mMap.end());
+    else if ( !strcmp(bamFile,"-") )
+        mFilebuf.attach(STDIN_FILENO);
+    else if ( !mFilebuf.open(bamFile) )
+        fatalReadErr(std::string("Can't open ") + bamFile + '.');
+    exceptions(std::ios_base::badbit);
 }
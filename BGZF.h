@@ -11,12 +11,37 @@
  * \author tsharpe
  * \date May 21, 2009
  *
- * \brief Utilities for writing BAM files.
+ * \brief Utilities for reading and writing BAM files.
  */
 #ifndef LOOKUP_BGZF_H_
 #define LOOKUP_BGZF_H_
 
+#include "FileIO.h"
+#include <deque>
 #include <fstream>
+#include <future>
+#include <memory>
+#include <vector>
+#include <zlib.h>
+
+class ThreadPool;
+
+// image of the header for a BAM file
+struct BAMAlignHead
+{
+    uint32_t mRemainingBlockSize;
+    int32_t mRefID;
+    int32_t mPos;
+    uint8_t mNameLen;
+    uint8_t mMapQ;
+    uint16_t mBin;
+    uint16_t mCigarLen;
+    uint16_t mFlags;
+    uint32_t mSeqLen;
+    int32_t mMateRefID;
+    int32_t mMatePos;
+    int32_t mTLen;
+};
 
 class GZIPHeader
 {
@@ -49,35 +74,102 @@ class BGZFBlock : public GZIPHeader
 public:
     // compiler-supplied no-arg constructor, copying and destructor are OK
 
-    // returns the amount of uncompressed data put into the block.
-    // if len is too big, or the data is too incompressible, not all of the supplied
-    // data will fit into a block.
-    unsigned int compress( void* data, unsigned int len );
+    // the most uncompressed data we'll put into a block.  deflate's worst case
+    // for this much data (and a stored block) still fits within mDataBlock.
+    static unsigned int const MAX_INPUT_SIZE = 0xff00;
 
-    unsigned int getBlockSize()
+    unsigned int getBlockSize() const
     { return mBlockSizeLessOne + 1U; }
 
 private:
-    bool tryCompress( void* data, unsigned int& len );
+    friend class BGZFCompressor;
+
+    // fills in the CRC, input size, and block size once compressedLen bytes
+    // of mDataBlock represent the len bytes of data
+    void finish( void const* data, unsigned int len, unsigned int compressedLen );
 
     // mBlockSizeLessOne is 16 bits, so 64K is the max block length and there are 26 bytes of header and footer
     unsigned char mDataBlock[64*1024UL-26UL];
     unsigned int mCRC32; // these last two members actually immediately follow the variable-length data block
     unsigned int mInputSize; // this struct is what a maximum-size block looks like
+};
+
+// deflates data into BGZF blocks, reusing a single z_stream.
+// level and strategy are as for zlib's deflateInit2.  level 0 writes stored
+// blocks directly, without involving zlib.
+class BGZFCompressor
+{
+public:
+    BGZFCompressor( int level = Z_DEFAULT_COMPRESSION, int strategy = Z_DEFAULT_STRATEGY );
+    ~BGZFCompressor();
+
+    // len must be no more than BGZFBlock::MAX_INPUT_SIZE.  it all goes into the block.
+    void compress( void const* data, unsigned int len, BGZFBlock& block );
+
+private:
+    BGZFCompressor( BGZFCompressor const& ); // undefined -- no copying
+    BGZFCompressor& operator=( BGZFCompressor const& ); // undefined -- no copying
+
+    // writes the data as a single deflate block of type "stored"
+    void store( void const* data, unsigned int len, BGZFBlock& block );
+
+    z_stream mZS;
+    int mLevel;
 
     static int const WINDOW_BITS = -15;
     static int const MEM_LEVEL = 8;
 };
 
+// if given a thread pool, filled buffers are compressed by the pool's workers,
+// and the finished blocks are written to psb in the order the data arrived.
+// ordinarily a block is cut wherever the buffer fills up.  with record-aligned
+// blocks, it's cut at the last record boundary the caller marked, and the rest
+// is carried over into the next block, so that each block can be parsed on its
+// own.  a record too big for that is split across blocks, as usual.
 class BGZFStreambuf : public std::streambuf
 {
 public:
-    BGZFStreambuf( std::streambuf* psb )
-    : mpSB(psb)
+    BGZFStreambuf( std::streambuf* psb, ThreadPool* pPool = 0,
+                    int level = Z_DEFAULT_COMPRESSION, int strategy = Z_DEFAULT_STRATEGY )
+    : mpSB(psb), mpPool(pPool), mLevel(level), mStrategy(strategy),
+      mNSubmitted(0), mNWritten(0), mNCompressedWritten(0), mTrackOffsets(false),
+      mRecordAligned(false), mLastBoundary(0), mCompressor(level,strategy)
     { setp(mBuf,mBuf+sizeof(mBuf)-1); }
 
-    ~BGZFStreambuf()
-    { sync(); }
+    ~BGZFStreambuf();
+
+    void setRecordAligned( bool aligned ) { mRecordAligned = aligned; }
+    bool isRecordAligned() const { return mRecordAligned; }
+
+    // notes that a record ends at what's been written so far
+    void markBoundary()
+    { mLastBoundary = pptr() - mBuf; }
+
+    // writes everything that's buffered, followed by the empty block that
+    // marks the end of a BGZF file
+    void writeEOF();
+
+    // writes everything that's buffered, followed by a block that's already
+    // compressed:  blockSize bytes of it, holding len bytes of data
+    void copyBlock( char const* block, unsigned blockSize, unsigned len );
+
+    // where each block starts is only remembered if we're asked to track
+    // offsets, which virtualOffset needs.  call this before writing anything.
+    void setTrackOffsets( bool track ) { mTrackOffsets = track; }
+
+    // how much uncompressed data has been written out as blocks
+    uint64_t getNWritten() const { return mNWritten; }
+
+    // translates an offset into the uncompressed data (such as tellp returns)
+    // into a BGZF virtual offset:  the compressed offset of the block holding
+    // it in the high 48 bits, and its offset within that block in the low 16.
+    // only works for data that's been written out, i.e., after a flush, and
+    // that hasn't been forgotten.
+    uint64_t virtualOffset( uint64_t offset ) const;
+
+    // forgets where the blocks before the one holding offset start.  offsets
+    // before that can no longer be translated.
+    void forgetOffsetsBefore( uint64_t offset );
 
 private:
     BGZFStreambuf( BGZFStreambuf const& ); // undefined -- no copying
@@ -85,19 +177,176 @@ private:
 
     int_type overflow( int_type ch );
     int sync();
+    pos_type seekoff( off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which );
+
+    // a chunk of uncompressed data, and the BGZF block it compresses into
+    struct Job
+    {
+        Job( int level, int strategy ) : mCompressor(level,strategy) {}
+
+        void compress()
+        { mCompressor.compress(&mData[0],mData.size(),mBlock); }
+
+        std::vector<char> mData;
+        BGZFCompressor mCompressor;
+        BGZFBlock mBlock;
+        std::future<void> mDone;
+    };
+
+    // compresses the first len bytes of the buffer, and moves what's left to
+    // its start
+    void emit( unsigned len );
+    void submit( unsigned len );
+    void writeJob();
+    void write( BGZFBlock const& block, unsigned len )
+    { write(reinterpret_cast<char const*>(&block),block.getBlockSize(),len); }
+    void write( char const* block, unsigned blockSize, unsigned len );
 
     std::streambuf* mpSB;
-    char mBuf[128UL*1024UL];
+    ThreadPool* mpPool;
+    int mLevel;
+    int mStrategy;
+    uint64_t mNSubmitted; // uncompressed bytes handed off for compression
+    uint64_t mNWritten; // uncompressed bytes written out as blocks
+    uint64_t mNCompressedWritten;
+    std::vector<uint64_t> mBlockStarts; // uncompressed offset of each block written
+    std::vector<uint64_t> mBlockAddrs; // and its compressed offset
+    bool mTrackOffsets;
+    bool mRecordAligned;
+    unsigned mLastBoundary; // offset in mBuf of the last record boundary, or 0
+    std::deque<std::unique_ptr<Job>> mPending; // oldest first
+    std::vector<std::unique_ptr<Job>> mIdle;
+    BGZFCompressor mCompressor;
+    BGZFBlock mBlock;
+    char mBuf[BGZFBlock::MAX_INPUT_SIZE]; // the last byte is reserved for overflow's ch
 };
 
+// a file name of "-" means standard output.  close writes the EOF marker block.
+// errors are thrown as std::runtime_error, as they are for BAMistream.
 class BAMostream : public std::ostream
 {
 public:
-    BAMostream( char const* bamFile );
+    BAMostream( char const* bamFile, ThreadPool* pPool = 0,
+                int level = Z_DEFAULT_COMPRESSION, int strategy = Z_DEFAULT_STRATEGY );
     void close();
 
-    std::filebuf mFilebuf;
+    WriteBehindFilebuf mFilebuf;
     BGZFStreambuf mSB;
 };
 
+// reads a BGZF file block by block.  if given a thread pool, upcoming blocks are
+// inflated by the pool's workers while the current one is being consumed.
+class BGZFInStreambuf : public std::streambuf
+{
+public:
+    BGZFInStreambuf( std::streambuf* psb, ThreadPool* pPool = 0 )
+    : mpSB(psb), mpPool(pPool), mAtEOF(false), mNextAddr(0), mpMapBeg(0), mpMapEnd(0),
+      mWillNeedAddr(0)
+    {}
+
+    ~BGZFInStreambuf();
+
+    // reads blocks straight out of a memory-mapped file, rather than from the
+    // streambuf.  call this before reading anything.
+    void useMapping( char const* beg, char const* end )
+    { mpMapBeg = beg; mpMapEnd = end; }
+
+    // a block of the file:  its address, its compressed form, and its data
+    struct Block
+    { uint64_t mAddr; char const* mpBlock; unsigned mBlockSize;
+      char const* mpData; unsigned mDataSize; };
+
+    // if the next byte to be read is the first of a block, describes the block
+    // and returns true.  what's described is good until the block's consumed.
+    bool atBlockStart( Block& block );
+
+    // consumes the rest of the current block
+    void skipBlock()
+    { setg(eback(),egptr(),egptr()); }
+
+    // the virtual offset of the next byte to be read:  the file address of its
+    // compressed block shifted left 16 bits, plus its offset within the block
+    uint64_t virtualTell();
+
+    // moves to a virtual offset, discarding any blocks read ahead.  returns
+    // false if the underlying file can't seek there.
+    bool virtualSeek( uint64_t offset );
+
+private:
+    BGZFInStreambuf( BGZFInStreambuf const& ); // undefined -- no copying
+    BGZFInStreambuf& operator=( BGZFInStreambuf const& ); // undefined -- no copying
+
+    int_type underflow();
+
+    // a compressed BGZF block, and the data it inflates into
+    struct Job
+    {
+        Job();
+        ~Job();
+        Job( Job const& )=delete;
+        Job& operator=( Job const& )=delete;
+
+        void inflate();
+
+        z_stream mZS;
+        uint64_t mAddr; // of the compressed block in the file
+        std::vector<char> mBlock; // a copy of the block, if it's not mapped
+        char const* mpBlock; // the block, in mBlock or the mapping
+        unsigned mBlockSize;
+        std::vector<char> mData;
+        char* mpData; // the inflated data, in mData or, if stored, the block
+        unsigned mDataSize;
+        std::future<void> mDone;
+    };
+
+    bool readBlock( Job& job );
+    bool readMappedBlock( Job& job );
+    void readAhead();
+
+    std::streambuf* mpSB;
+    ThreadPool* mpPool;
+    bool mAtEOF;
+    uint64_t mNextAddr; // of the next compressed block to read
+    char const* mpMapBeg;
+    char const* mpMapEnd;
+    uint64_t mWillNeedAddr; // when mNextAddr reaches this, ask for more of the mapping
+    std::unique_ptr<Job> mpCurrent;
+    std::deque<std::unique_ptr<Job>> mPending; // oldest first
+    std::vector<std::unique_ptr<Job>> mIdle;
+};
+
+// a read-only mapping of a whole file, or of standard input if the file is "-"
+// (and it's redirected from a file).  it's not mapped if it's not a regular
+// file, or is empty, or the mmap fails, and then it's up to the caller to read
+// the file some other way.
+class MappedFile
+{
+public:
+    explicit MappedFile( char const* file );
+    MappedFile( MappedFile const& )=delete;
+    MappedFile& operator=( MappedFile const& )=delete;
+    ~MappedFile();
+
+    bool isMapped() const { return mpData; }
+    char const* begin() const { return mpData; }
+    char const* end() const { return mpData + mSize; }
+
+private:
+    char const* mpData;
+    size_t mSize;
+};
+
+// local files are read through a memory mapping, anything else (a pipe, say)
+// through a read-ahead thread.  a file name of "-" means standard input.  a
+// file that can't be opened or read, or isn't BGZF, throws std::runtime_error.
+class BAMistream : public std::istream
+{
+public:
+    BAMistream( char const* bamFile, ThreadPool* pPool = 0 );
+
+    MappedFile mMap;
+    ReadAheadFilebuf mFilebuf;
+    BGZFInStreambuf mSB;
+};
+
 #endif /* LOOKUP_BGZF_H_ */
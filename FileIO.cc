@@ -0,0 +1,258 @@
+/*
+ * FileIO.cc
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include "FileIO.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+IOBuffers::IOBuffers()
+: mpMem(0)
+{
+    void* pMem;
+    if ( posix_memalign(&pMem,4096,N_BUFS*BUF_SIZE) )
+        throw std::bad_alloc();
+    mpMem = static_cast<char*>(pMem);
+}
+
+IOBuffers::~IOBuffers()
+{
+    free(mpMem);
+}
+
+bool ReadAheadFilebuf::open( char const* file )
+{
+    int fd = ::open(file,O_RDONLY);
+    if ( fd == -1 )
+        return false; // EARLY RETURN!
+    attach(fd);
+    return true;
+}
+
+void ReadAheadFilebuf::attach( int fd )
+{
+    close();
+    mFD = fd;
+    if ( !mpBufs )
+        mpBufs.reset(new IOBuffers);
+    // a hint, so it doesn't matter if it fails (on a pipe, say)
+    posix_fadvise(mFD,0,0,POSIX_FADV_SEQUENTIAL);
+    off_t pos = lseek(mFD,0,SEEK_CUR);
+    mPos = pos == -1 ? 0 : pos;
+    start();
+}
+
+void ReadAheadFilebuf::close()
+{
+    stop();
+    if ( mFD != -1 )
+    {
+        ::close(mFD);
+        mFD = -1;
+    }
+}
+
+ReadAheadFilebuf::int_type ReadAheadFilebuf::underflow()
+{
+    if ( gptr() < egptr() )
+        return traits_type::to_int_type(*gptr());
+
+    if ( mCurrent.mpData )
+    {
+        mPos += mCurrent.mLen;
+        mpFree->push(mCurrent);
+        mCurrent = Chunk();
+        setg(0,0,0);
+    }
+    if ( !mpFull || !mpFull->pop(mCurrent) )
+        return traits_type::eof(); // EARLY RETURN!
+    setg(mCurrent.mpData,mCurrent.mpData,mCurrent.mpData+mCurrent.mLen);
+    return traits_type::to_int_type(*gptr());
+}
+
+ReadAheadFilebuf::pos_type ReadAheadFilebuf::seekoff( off_type off, std::ios_base::seekdir dir,
+                                                        std::ios_base::openmode which )
+{
+    if ( mFD == -1 || !(which & std::ios_base::in) || dir == std::ios_base::end )
+        return pos_type(off_type(-1)); // EARLY RETURN!
+    off_type pos = off;
+    if ( dir == std::ios_base::cur )
+    {
+        pos += mPos + (gptr() - eback());
+        if ( !off )
+            return pos_type(pos); // EARLY RETURN!  just asking where we are
+    }
+    return seekpos(pos_type(pos),which);
+}
+
+ReadAheadFilebuf::pos_type ReadAheadFilebuf::seekpos( pos_type pos, std::ios_base::openmode which )
+{
+    if ( mFD == -1 || !(which & std::ios_base::in) )
+        return pos_type(off_type(-1)); // EARLY RETURN!
+    stop();
+    if ( lseek(mFD,off_type(pos),SEEK_SET) == -1 )
+        return pos_type(off_type(-1)); // EARLY RETURN!  and underflow returns eof
+    mPos = off_type(pos);
+    start();
+    return pos;
+}
+
+void ReadAheadFilebuf::start()
+{
+    mStopping = false;
+    mpFree.reset(new BoundedQueue<Chunk>(IOBuffers::N_BUFS));
+    mpFull.reset(new BoundedQueue<Chunk>(IOBuffers::N_BUFS));
+    for ( unsigned idx = 0; idx != IOBuffers::N_BUFS; ++idx )
+        mpFree->push(Chunk(mpBufs->buf(idx),0));
+    mThread = std::thread(&ReadAheadFilebuf::readLoop,this);
+}
+
+void ReadAheadFilebuf::stop()
+{
+    if ( mThread.joinable() )
+    {
+        mStopping = true;
+        mpFree->close();
+        mThread.join();
+    }
+    mpFree.reset();
+    mpFull.reset();
+    mCurrent = Chunk();
+    setg(0,0,0);
+}
+
+// reads a buffer-full at a time until end of file, an error, or a stop.  once
+// a buffer's read, the kernel's asked to start on the next one.
+void ReadAheadFilebuf::readLoop()
+{
+    off_t pos = lseek(mFD,0,SEEK_CUR);
+    Chunk chunk;
+    while ( !mStopping && mpFree->pop(chunk) )
+    {
+        ssize_t len;
+        while ( (len = read(mFD,chunk.mpData,IOBuffers::BUF_SIZE)) == -1 && errno == EINTR )
+            ;
+        if ( len <= 0 )
+        {
+            mFailed = mFailed || len;
+            break;
+        }
+        if ( pos != -1 )
+        {
+            pos += len;
+            posix_fadvise(mFD,pos,IOBuffers::BUF_SIZE,POSIX_FADV_WILLNEED);
+        }
+        chunk.mLen = len;
+        mpFull->push(chunk);
+    }
+    mpFull->close();
+}
+
+bool WriteBehindFilebuf::open( char const* file )
+{
+    int fd = ::open(file,O_WRONLY|O_CREAT|O_TRUNC,0666);
+    if ( fd == -1 )
+        return false; // EARLY RETURN!
+    attach(fd);
+    return true;
+}
+
+void WriteBehindFilebuf::attach( int fd )
+{
+    close();
+    mFD = fd;
+    mFailed = false;
+    if ( !mpBufs )
+        mpBufs.reset(new IOBuffers);
+    mpFree.reset(new BoundedQueue<Chunk>(IOBuffers::N_BUFS));
+    mpFull.reset(new BoundedQueue<Chunk>(IOBuffers::N_BUFS));
+    for ( unsigned idx = 1; idx != IOBuffers::N_BUFS; ++idx )
+        mpFree->push(Chunk(mpBufs->buf(idx),0));
+    setp(mpBufs->buf(0),mpBufs->buf(0)+IOBuffers::BUF_SIZE);
+    mThread = std::thread(&WriteBehindFilebuf::writeLoop,this);
+}
+
+bool WriteBehindFilebuf::close()
+{
+    if ( mFD == -1 )
+        return true; // EARLY RETURN!
+    handOff();
+    mpFull->close();
+    mThread.join();
+    if ( ::close(mFD) )
+        mFailed = true;
+    mFD = -1;
+    mpFree.reset();
+    mpFull.reset();
+    setp(0,0);
+    return !mFailed;
+}
+
+WriteBehindFilebuf::int_type WriteBehindFilebuf::overflow( int_type ch )
+{
+    if ( mFD == -1 || mFailed )
+        return traits_type::eof(); // EARLY RETURN!
+    handOff();
+    if ( ch != traits_type::eof() )
+    {
+        *pptr() = ch;
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+// doesn't wait for the data to reach the file:  that's up to close
+int WriteBehindFilebuf::sync()
+{
+    if ( mFD == -1 )
+        return -1; // EARLY RETURN!
+    handOff();
+    return mFailed ? -1 : 0;
+}
+
+// passes the filled part of the buffer to the I/O thread, and takes a free one
+void WriteBehindFilebuf::handOff()
+{
+    size_t len = pptr() - pbase();
+    if ( !len )
+        return; // EARLY RETURN!
+    mpFull->push(Chunk(pbase(),len));
+    Chunk chunk;
+    mpFree->pop(chunk);
+    setp(chunk.mpData,chunk.mpData+IOBuffers::BUF_SIZE);
+}
+
+// after each buffer's written, the kernel's told to start writing it to disk,
+// without waiting for that to finish.  the data stays in the page cache, where
+// whatever reads the file next can find it.  none of that works on a pipe, and
+// it's skipped there.
+void WriteBehindFilebuf::writeLoop()
+{
+    off_t pos = lseek(mFD,0,SEEK_CUR);
+    Chunk chunk;
+    while ( mpFull->pop(chunk) )
+    {
+        char const* itr = chunk.mpData;
+        char const* end = itr + chunk.mLen;
+        while ( !mFailed && itr != end )
+        {
+            ssize_t len = write(mFD,itr,end-itr);
+            if ( len > 0 )
+                itr += len;
+            else if ( len == 0 || errno != EINTR )
+                mFailed = true;
+        }
+        if ( !mFailed && pos != -1 )
+        {
+#ifdef SYNC_FILE_RANGE_WRITE
+            sync_file_range(mFD,pos,chunk.mLen,SYNC_FILE_RANGE_WRITE);
+#endif
+            pos += chunk.mLen;
+        }
+        mpFree->push(chunk);
+    }
+}
@@ -0,0 +1,129 @@
+/*
+ * FileIO.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef FILEIO_H_
+#define FILEIO_H_
+
+#include "ThreadPool.h"
+#include <atomic>
+#include <ios>
+#include <memory>
+#include <streambuf>
+#include <thread>
+#include <stddef.h>
+#include <stdint.h>
+
+// a few big, page-aligned buffers that a streambuf and its I/O thread pass back
+// and forth.  the filebufs make theirs when a file's opened, so that one that's
+// never used (a BAMistream's, when the file's mapped) costs nothing.
+class IOBuffers
+{
+public:
+    static size_t const BUF_SIZE = 4ul << 20;
+    static unsigned const N_BUFS = 2;
+
+    IOBuffers();
+    IOBuffers( IOBuffers const& )=delete;
+    IOBuffers& operator=( IOBuffers const& )=delete;
+    ~IOBuffers();
+
+    char* buf( unsigned idx ) const { return mpMem + idx*BUF_SIZE; }
+
+    // a buffer, and how much of it holds data
+    struct Chunk
+    { Chunk() : mpData(0), mLen(0) {}
+      Chunk( char* pData, size_t len ) : mpData(pData), mLen(len) {}
+      char* mpData; size_t mLen; };
+
+private:
+    char* mpMem;
+};
+
+// reads a file on a dedicated thread, so that the reading runs ahead of the
+// thread that consumes the data:  a stall in the file system doesn't stall the
+// computation until the buffers run dry.  seeking stops the thread, and
+// restarts it at the new position.
+class ReadAheadFilebuf : public std::streambuf
+{
+public:
+    ReadAheadFilebuf() : mFD(-1), mPos(0), mStopping(false), mFailed(false) {}
+    ReadAheadFilebuf( ReadAheadFilebuf const& )=delete;
+    ReadAheadFilebuf& operator=( ReadAheadFilebuf const& )=delete;
+    ~ReadAheadFilebuf() { close(); }
+
+    // returns false if the file can't be opened
+    bool open( char const* file );
+
+    // reads a file that's already open, such as standard input, from wherever
+    // it's at.  it's closed along with this.
+    void attach( int fd );
+
+    void close();
+
+    // true if a read failed (rather than reaching end of file)
+    bool failed() const { return mFailed; }
+
+private:
+    int_type underflow();
+    pos_type seekoff( off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which );
+    pos_type seekpos( pos_type pos, std::ios_base::openmode which );
+
+    void start();
+    void stop();
+    void readLoop();
+
+    typedef IOBuffers::Chunk Chunk;
+    int mFD;
+    uint64_t mPos; // file offset of the start of the get area
+    std::unique_ptr<IOBuffers> mpBufs;
+    std::unique_ptr<BoundedQueue<Chunk>> mpFree;
+    std::unique_ptr<BoundedQueue<Chunk>> mpFull;
+    std::atomic<bool> mStopping;
+    std::atomic<bool> mFailed;
+    Chunk mCurrent;
+    std::thread mThread;
+};
+
+// writes a file on a dedicated thread, so that the thread that fills the
+// buffers needn't wait for the file system.  the kernel's asked to start
+// writing each buffer back as soon as it's been written, so that dirty pages
+// don't pile up until close.
+class WriteBehindFilebuf : public std::streambuf
+{
+public:
+    WriteBehindFilebuf() : mFD(-1), mFailed(false) {}
+    WriteBehindFilebuf( WriteBehindFilebuf const& )=delete;
+    WriteBehindFilebuf& operator=( WriteBehindFilebuf const& )=delete;
+    ~WriteBehindFilebuf() { close(); }
+
+    // creates or truncates the file.  returns false if it can't be opened.
+    bool open( char const* file );
+
+    // writes to a file that's already open, such as standard output.  it's
+    // closed along with this.
+    void attach( int fd );
+
+    // writes whatever's buffered, and closes the file.  returns false if any
+    // write failed.
+    bool close();
+
+private:
+    int_type overflow( int_type ch );
+    int sync();
+
+    void handOff();
+    void writeLoop();
+
+    typedef IOBuffers::Chunk Chunk;
+    int mFD;
+    std::unique_ptr<IOBuffers> mpBufs;
+    std::unique_ptr<BoundedQueue<Chunk>> mpFree;
+    std::unique_ptr<BoundedQueue<Chunk>> mpFull;
+    std::atomic<bool> mFailed;
+    std::thread mThread;
+};
+
+#endif /* FILEIO_H_ */
@@ -0,0 +1,390 @@
+/*
+ * OQBench.cc
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+// throughput benchmarks for the quality codec and for BGZF compression, on
+// synthetic reads, and an end-to-end run of OQCompress on a generated BAM.
+// "make bench" runs it.
+
+#include "BGZF.h"
+#include "QualCompressor.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace
+{
+
+unsigned const QUAL_OFFSET = 33;
+
+// a bunch of reads' quals, as printable characters, end to end
+struct QualSet
+{
+    void add( std::vector<char> const& quals )
+    { mOffsets.push_back(mQuals.size());
+      mQuals.insert(mQuals.end(),quals.begin(),quals.end()); }
+
+    // sets up mPtrs and mLens once all the reads have been added
+    void index()
+    { mOffsets.push_back(mQuals.size());
+      mPtrs.clear(); mLens.clear();
+      for ( size_t idx = 0; idx+1 < mOffsets.size(); ++idx )
+      { mPtrs.push_back(&mQuals[mOffsets[idx]]);
+        mLens.push_back(mOffsets[idx+1]-mOffsets[idx]); } }
+
+    size_t nReads() const { return mPtrs.size(); }
+
+    std::vector<char> mQuals;
+    std::vector<size_t> mOffsets;
+    std::vector<char const*> mPtrs;
+    std::vector<uint32_t> mLens;
+};
+
+// makes up quality scores that look more or less like those of various platforms
+class QualGenerator
+{
+public:
+    enum Profile { HISEQ, NOVASEQ, LONG };
+
+    QualGenerator( Profile profile ) : mProfile(profile), mRNG(profile+1) {}
+
+    static char const* name( Profile profile )
+    { static char const* const NAMES[] = { "hiseq", "novaseq", "long" };
+      return NAMES[profile]; }
+
+    // appends one read's worth of printable quals to quals
+    void generate( std::vector<char>& quals )
+    { quals.clear();
+      switch ( mProfile )
+      {
+      case HISEQ: hiseq(quals); break;
+      case NOVASEQ: novaseq(quals); break;
+      case LONG: longRead(quals); break;
+      } }
+
+private:
+    unsigned uniform( unsigned lo, unsigned hi )
+    { return std::uniform_int_distribution<unsigned>(lo,hi)(mRNG); }
+
+    // full-resolution quals that droop toward the end of the read, with a
+    // tail of 2s on some reads
+    void hiseq( std::vector<char>& quals )
+    { unsigned const LEN = 150;
+      unsigned tail = uniform(0,9) ? LEN : uniform(LEN/2,LEN);
+      int base = uniform(32,38);
+      for ( unsigned idx = 0; idx != LEN; ++idx )
+      { int val = base - int(idx*8/LEN) + int(uniform(0,8)) - 4;
+        if ( !uniform(0,40) ) val -= uniform(5,20);
+        if ( idx >= tail ) val = 2;
+        quals.push_back(std::max(2,std::min(41,val)) + QUAL_OFFSET); } }
+
+    // quals in 4 bins, mostly the top one
+    void novaseq( std::vector<char>& quals )
+    { unsigned const LEN = 150;
+      for ( unsigned idx = 0; idx != LEN; ++idx )
+      { unsigned roll = uniform(0,99);
+        unsigned val = roll < 85 ? 37 : roll < 94 ? 23 : roll < 99 ? 12 : 2;
+        quals.push_back(val + QUAL_OFFSET); } }
+
+    // long reads with long runs of the same qual
+    void longRead( std::vector<char>& quals )
+    { unsigned len = uniform(5000,20000);
+      while ( quals.size() < len )
+      { unsigned val = uniform(5,40);
+        unsigned runLen = std::geometric_distribution<unsigned>(1./20)(mRNG) + 1;
+        quals.insert(quals.end(),std::min<size_t>(runLen,len-quals.size()),
+                        char(val+QUAL_OFFSET)); } }
+
+    Profile mProfile;
+    std::mt19937 mRNG;
+};
+
+// a streambuf that just counts what's written to it
+class CountingStreambuf : public std::streambuf
+{
+public:
+    CountingStreambuf() : mCount(0) {}
+    size_t getCount() const { return mCount; }
+
+private:
+    int_type overflow( int_type ch )
+    { if ( ch != traits_type::eof() ) mCount += 1; return traits_type::not_eof(ch); }
+    std::streamsize xsputn( char const*, std::streamsize n )
+    { mCount += n; return n; }
+
+    size_t mCount;
+};
+
+template <class F>
+double timeIt( F func )
+{
+    auto start = std::chrono::steady_clock::now();
+    func();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+}
+
+void report( char const* profile, std::string const& test, size_t nBytes,
+                size_t nReads, double secs, double ratio )
+{
+    std::cout << std::left << std::setw(9) << profile << std::setw(22) << test
+              << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << nBytes/secs/1e6
+              << std::setw(12) << std::setprecision(0) << nReads/secs;
+    if ( ratio > 0. )
+        std::cout << std::setw(8) << std::setprecision(3) << ratio;
+    std::cout << std::endl;
+}
+
+// BGZF-compresses len bytes of data into the void, returns the compressed size
+size_t bgzfCompress( char const* data, size_t len, ThreadPool* pPool, int level )
+{
+    CountingStreambuf counter;
+    { BGZFStreambuf sb(&counter,pPool,level);
+      std::ostream os(&sb);
+      os.write(data,len);
+      os.flush(); }
+    return counter.getCount();
+}
+
+void benchCodec( QualGenerator::Profile profile, size_t nQuals )
+{
+    QualSet qs;
+    QualGenerator gen(profile);
+    std::vector<char> quals;
+    while ( qs.mQuals.size() < nQuals )
+    {
+        gen.generate(quals);
+        qs.add(quals);
+    }
+    qs.index();
+    char const* name = QualGenerator::name(profile);
+    size_t nBytes = qs.mQuals.size();
+    size_t nReads = qs.nReads();
+
+    for ( bool fast : { false, true } )
+    {
+        std::string suffix = fast ? " --fast" : "";
+        QualCompressor qc(fast);
+        size_t packedSize = 0;
+        double secs = timeIt([&]
+        { for ( size_t idx = 0; idx != nReads; ++idx )
+              packedSize += qc.plan(qs.mPtrs[idx],qs.mLens[idx],QUAL_OFFSET); });
+        report(name,"configureBlocks"+suffix,nBytes,nReads,secs,double(packedSize)/nBytes);
+
+        std::vector<char> packed;
+        std::vector<size_t> offsets;
+        secs = timeIt([&]
+        { qc.encode(qs.mPtrs.data(),qs.mLens.data(),nReads,QUAL_OFFSET,packed,offsets); });
+        report(name,"encode"+suffix,nBytes,nReads,secs,double(packed.size())/nBytes);
+        if ( fast )
+            continue;
+
+        QualSet zqs;
+        zqs.mQuals.swap(packed);
+        zqs.mOffsets.swap(offsets);
+        zqs.mOffsets.pop_back();
+        zqs.index();
+        std::vector<char> unpacked;
+        secs = timeIt([&]
+        { qc.decode(zqs.mPtrs.data(),zqs.mLens.data(),qs.mLens.data(),nReads,QUAL_OFFSET,
+                    unpacked,offsets); });
+        report(name,"decode",nBytes,nReads,secs,0.);
+        if ( unpacked != qs.mQuals )
+        {
+            std::cout << "Decoded quals don't match the originals for " << name << std::endl;
+            exit(1);
+        }
+
+        for ( int level : { 1, 6 } )
+        {
+            size_t size;
+            secs = timeIt([&]
+            { size = bgzfCompress(qs.mQuals.data(),nBytes,0,level); });
+            report(name,"bgzf OQ -l"+std::to_string(level),nBytes,nReads,secs,double(size)/nBytes);
+            secs = timeIt([&]
+            { size = bgzfCompress(zqs.mQuals.data(),zqs.mQuals.size(),0,level); });
+            report(name,"bgzf ZQ -l"+std::to_string(level),zqs.mQuals.size(),nReads,secs,
+                    double(size)/zqs.mQuals.size());
+        }
+    }
+
+    // entropy coding, where it's smaller than packing
+    QualCompressor qc(false,false,true);
+    std::vector<char> coded;
+    std::vector<size_t> offsets;
+    double secs = timeIt([&]
+    { qc.encode(qs.mPtrs.data(),qs.mLens.data(),nReads,QUAL_OFFSET,coded,offsets); });
+    report(name,"encode --rans",nBytes,nReads,secs,double(coded.size())/nBytes);
+    QualSet zqs;
+    zqs.mQuals.swap(coded);
+    zqs.mOffsets.swap(offsets);
+    zqs.mOffsets.pop_back();
+    zqs.index();
+    std::vector<char> decoded;
+    secs = timeIt([&]
+    { qc.decode(zqs.mPtrs.data(),zqs.mLens.data(),qs.mLens.data(),nReads,QUAL_OFFSET,
+                decoded,offsets); });
+    report(name,"decode --rans",nBytes,nReads,secs,0.);
+    if ( decoded != qs.mQuals )
+    {
+        std::cout << "rANS-decoded quals don't match the originals for " << name << std::endl;
+        exit(1);
+    }
+}
+
+void put( std::vector<char>& rec, void const* data, size_t len )
+{
+    char const* ptr = static_cast<char const*>(data);
+    rec.insert(rec.end(),ptr,ptr+len);
+}
+
+void put16( std::vector<char>& rec, uint16_t val )
+{ put(rec,&val,sizeof(val)); }
+
+void put32( std::vector<char>& rec, uint32_t val )
+{ put(rec,&val,sizeof(val)); }
+
+// writes a BAM of unaligned reads with binned quals and an OQ tag holding
+// the originals.  returns the number of reads.
+size_t writeBAM( std::string const& fileName, QualGenerator::Profile profile,
+                    size_t nQuals )
+{
+    BAMostream os(fileName.c_str());
+    static char const HEADER[] = "@HD\tVN:1.6\tSO:unsorted\n@RG\tID:bench\n";
+    std::vector<char> rec;
+    put(rec,"BAM\1",4);
+    put32(rec,sizeof(HEADER)-1);
+    put(rec,HEADER,sizeof(HEADER)-1);
+    put32(rec,0); // no reference sequences
+    os.write(rec.data(),rec.size());
+
+    QualGenerator gen(profile);
+    std::mt19937 rng(17);
+    std::vector<char> quals;
+    size_t nReads = 0;
+    for ( size_t nDone = 0; nDone < nQuals; nDone += quals.size() )
+    {
+        gen.generate(quals);
+        std::string name = "read" + std::to_string(nReads++);
+        uint32_t len = quals.size();
+        rec.clear();
+        put32(rec,0); // block size, filled in below
+        put32(rec,-1); // ref ID
+        put32(rec,-1); // pos
+        rec.push_back(name.size()+1);
+        rec.push_back(0); // mapq
+        put16(rec,4680); // bin
+        put16(rec,0); // no cigar ops
+        put16(rec,4); // unmapped
+        put32(rec,len);
+        put32(rec,-1); // mate ref ID
+        put32(rec,-1); // mate pos
+        put32(rec,0); // template length
+        put(rec,name.c_str(),name.size()+1);
+        for ( uint32_t idx = 0; idx < len; idx += 2 )
+            rec.push_back("\x11\x12\x14\x18\x21\x22\x24\x28"[rng()&7]);
+        for ( char qual : quals ) // binned quals in QUAL, the originals in OQ
+        {
+            unsigned val = qual - QUAL_OFFSET;
+            rec.push_back(val < 10 ? 2 : val < 20 ? 12 : val < 30 ? 23 : 37);
+        }
+        put(rec,"RGZbench",9);
+        put(rec,"OQZ",3);
+        put(rec,quals.data(),len);
+        rec.push_back(0);
+        uint32_t blockSize = rec.size() - sizeof(blockSize);
+        memcpy(&rec[0],&blockSize,sizeof(blockSize));
+        os.write(rec.data(),rec.size());
+    }
+    os.close();
+    if ( !os )
+    {
+        std::cout << "Can't write " << fileName << std::endl;
+        exit(1);
+    }
+    return nReads;
+}
+
+size_t fileSize( std::string const& fileName )
+{
+    struct stat sb;
+    if ( stat(fileName.c_str(),&sb) )
+    {
+        std::cout << "Can't stat " << fileName << std::endl;
+        exit(1);
+    }
+    return sb.st_size;
+}
+
+// times OQCompress converting a generated BAM to ZQ tags, and back again
+void benchEndToEnd( QualGenerator::Profile profile, size_t nQuals, std::string const& prog )
+{
+    char const* tmpDir = getenv("TMPDIR");
+    std::string base = std::string(tmpDir ? tmpDir : "/tmp") + "/OQBench." +
+                            std::to_string(getpid());
+    std::string files[] = { base + ".oq.bam", base + ".zq.bam", base + ".rt.bam" };
+    size_t nReads = writeBAM(files[0],profile,nQuals);
+    char const* name = QualGenerator::name(profile);
+
+    std::vector<unsigned> threadCounts{0};
+    unsigned nCPUs = std::thread::hardware_concurrency();
+    if ( nCPUs > 1 )
+        threadCounts.push_back(nCPUs);
+    for ( unsigned nThreads : threadCounts )
+    {
+        for ( unsigned idx = 0; idx != 2; ++idx )
+        {
+            std::string const& in = files[idx];
+            std::string const& out = files[idx+1];
+            std::string cmd = prog + " -@" + std::to_string(nThreads) + " " + in + " " + out;
+            int status;
+            double secs = timeIt([&]{ status = system(cmd.c_str()); });
+            if ( status )
+            {
+                std::cout << "Failed: " << cmd << std::endl;
+                exit(1);
+            }
+            std::string test = std::string(idx ? "ZQ->OQ" : "OQ->ZQ") +
+                                " -@" + std::to_string(nThreads);
+            size_t inSize = fileSize(in);
+            report(name,test,inSize,nReads,secs,double(fileSize(out))/inSize);
+        }
+    }
+    for ( std::string const& file : files )
+        unlink(file.c_str());
+}
+
+} // end of anonymous namespace
+
+int main( int argc, char** argv )
+{
+    size_t nMQuals = argc > 1 ? strtoul(argv[1],0,10) : 10;
+    std::string prog = argc > 2 ? argv[2] : "./OQCompress";
+    if ( !nMQuals || argc > 3 )
+    {
+        std::cout << "Usage: OQBench [millions of quals per test] [path to OQCompress]\n"
+                     "MB/s is for the input to each test, and ratio is the size of its\n"
+                     "output over the size of its input." << std::endl;
+        exit(1);
+    }
+
+    std::cout << std::left << std::setw(9) << "profile" << std::setw(22) << "test"
+              << std::right << std::setw(10) << "MB/s" << std::setw(12) << "reads/s"
+              << std::setw(8) << "ratio" << std::endl;
+    for ( auto profile : { QualGenerator::HISEQ, QualGenerator::NOVASEQ, QualGenerator::LONG } )
+        benchCodec(profile,nMQuals*1000000);
+    for ( auto profile : { QualGenerator::HISEQ, QualGenerator::NOVASEQ, QualGenerator::LONG } )
+        benchEndToEnd(profile,nMQuals*1000000,prog);
+}
@@ -5,32 +5,37 @@
  *      Author: tsharpe
  */
 
+#include "BAMIndex.h"
 #include "BGZF.h"
-#include "gzstream.h"
+#include "QualCompressor.h"
+#include "Stats.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <numeric>
 #include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
 
+// anything that stops a file's conversion is thrown as a std::runtime_error,
+// so that, in a manifest, the other files can carry on
 #define BAMERR(file,message)  \
-     (std::cout << "\nBAM file " << file << message << '\n'), exit(1)
-
-// image of the header for a BAM file
-struct BAMAlignHead
-{
-    uint32_t mRemainingBlockSize;
-    int32_t mRefID;
-    int32_t mPos;
-    uint8_t mNameLen;
-    uint8_t mMapQ;
-    uint16_t mBin;
-    uint16_t mCigarLen;
-    uint16_t mFlags;
-    uint32_t mSeqLen;
-    int32_t mMateRefID;
-    int32_t mMatePos;
-    int32_t mTLen;
-};
+     do { std::ostringstream oss; oss << "BAM file " << file << message; \
+          throw std::runtime_error(oss.str()); } while ( false )
 
 // auxiliary tags signal the data type of the tag with these characters
 // a return of 0 means "variable length"
@@ -49,429 +54,1223 @@ inline int getTagLength( char dataType )
     return tagLen;
 }
 
-// class to do quality score compression and decompression
-class QualCompressor
+// how OQ tags are to be packed
+struct CodecOptions
+{
+    CodecOptions()
+    : mFast(false), mDelta(false), mRans(false), mVerify(false), mpEncodeDict(0),
+      mpDecodeDict(0) {}
+    bool mFast; // choose blocks greedily
+    bool mDelta; // pack against QUAL, when that's smaller
+    bool mRans; // entropy code, when that's smaller
+    bool mVerify; // unpack what's packed, and checksum the records
+    QualDict const* mpEncodeDict; // pack ranks, when that's smaller
+    QualDict const* mpDecodeDict; // for ZQ tags packed as ranks
+};
+
+// the options that apply to each file converted
+struct FileOptions
+{
+    FileOptions()
+    : mLevel(Z_DEFAULT_COMPRESSION), mStrategy(Z_DEFAULT_STRATEGY), mDict(false),
+      mBAI(false), mCSI(false), mCopyBlocks(false), mAlignedBlocks(false), mpRegion(0) {}
+    CodecOptions mCodecs;
+    int mLevel;
+    int mStrategy;
+    bool mDict; // make a qual dictionary for the output
+    bool mBAI;
+    bool mCSI;
+    bool mCopyBlocks; // copy input blocks that need no changes
+    bool mAlignedBlocks; // cut output blocks only between alignments
+    char const* mpRegion; // or null, for all the alignments
+};
+
+// rewrites alignment records, turning OQ tags into ZQ tags and vice versa.
+// everything else is copied verbatim.  alignments are scanned one at a time to
+// find their OQ and ZQ tags, then all their quals are converted at once.
+class RecordConverter
 {
 public:
-    QualCompressor() {}
-    QualCompressor( QualCompressor const& )=delete;
-    QualCompressor& operator=( QualCompressor const& )=delete;
+    RecordConverter( char const* inFile, CodecOptions const& opts )
+    : mQC(opts.mFast,opts.mDelta,opts.mRans), mVerify(opts.mVerify), mCRC(0), mCRCLen(0),
+      mNBases(0), mInFile(inFile)
+    { mQC.setDicts(opts.mpEncodeDict,opts.mpDecodeDict);
+      mVerifyQC.setDicts(0,opts.mpEncodeDict); }
+    RecordConverter( RecordConverter const& )=delete;
+    RecordConverter& operator=( RecordConverter const& )=delete;
 
-    std::vector<uint8_t>& encode( std::vector<uint8_t> const& quals );
-    std::vector<uint8_t>& decode( std::vector<uint8_t> const& packedQuals );
+    // rec points to an alignment's data, just past its block size, and len is
+    // that block size.  the data must stay put until the next call to convert.
+    void scan( char const* rec, uint32_t len, size_t alnNo );
 
-private:
-    size_t packedSize() const
-    { return std::accumulate(mBlocks.begin(),mBlocks.end(),0ul,
-           []( size_t acc, Block const& blk ) { return acc+blk.size(); }); }
+    // the rewritten versions of all the alignments scanned since the last call,
+    // including their block sizes, are appended to out.
+    void convert( std::vector<char>& out );
+
+    QualCompressor::Sample const& getSample() const { return mQC.getSample(); }
+
+    // adds the quals of the OQ tags scanned since the last call to convert to
+    // counts, which is indexed by score
+    void countOQs( uint64_t* counts ) const;
+
+    // when verifying, the CRC32 and length of the alignments rewritten by the
+    // last call to convert, in their OQ form:  as read, if they had OQ tags,
+    // or as written, if they had ZQ tags.  that's the same for a file and its
+    // conversion, whichever way it went.
+    uint32_t getCRC() const { return mCRC; }
+    uint64_t getCRCLen() const { return mCRCLen; }
 
-    void configureBlocks( std::vector<uint8_t> const& quals );
+private:
+    static void append( std::vector<char>& out, char const* beg, char const* end )
+    { out.insert(out.end(),beg,end); }
 
-    static int nlz( uint32_t val )
-    { return val ? __builtin_clz(val) : 32; }
+    // unpacks the freshly packed OQ tags, and exits with an error message if
+    // any of them isn't just what it was
+    void verify();
 
-    static int ceilLg2( uint32_t val )
-    { return 32-nlz(val-1); }
+    struct Record
+    { char const* mBeg; char const* mEnd; size_t mNTags; };
 
-    struct Block
-    { Block( uint8_t nQs, uint8_t bits, uint8_t minQ )
-      : mNQs(nQs), mBits(bits), mMinQ(minQ) {}
-      unsigned size() const { return blockSize(mNQs,mBits); }
-      static unsigned blockSize( unsigned nQs, unsigned nBits )
-      { return (nQs*nBits+17+7)>>3; }
-      uint8_t mNQs; uint8_t mBits; uint8_t mMinQ; };
+    // an OQ or ZQ tag that's to be replaced.  mIdx is its index in mOQs or mZQs.
+    struct QualTag
+    { char const* mBeg; char const* mEnd; size_t mAlnNo; uint32_t mIdx; bool mIsOQ; };
 
-    std::vector<Block> mBlocks;
-    std::vector<unsigned> mCosts;
-    std::vector<uint8_t> mBuffer;
+    QualCompressor mQC;
+    QualCompressor mVerifyQC;
+    bool mVerify;
+    uint32_t mCRC;
+    uint64_t mCRCLen;
+    std::vector<Record> mRecords;
+    std::vector<QualTag> mTags;
+    std::vector<char const*> mOQs; // the quals of each OQ tag
+    std::vector<uint32_t> mOQLens;
+    std::vector<QualCompressor::Recal> mOQRecals; // and its read's QUAL
+    std::vector<char const*> mZQs; // the packed quals of each ZQ tag
+    std::vector<uint32_t> mZQLens;
+    std::vector<uint32_t> mZQNQuals; // its read's length
+    std::vector<QualCompressor::Recal> mZQRecals;
+    std::vector<char> mPacked;
+    std::vector<size_t> mPackedOffsets;
+    std::vector<char> mUnpacked;
+    std::vector<size_t> mUnpackedOffsets;
+    std::vector<char const*> mRepacked; // verification's view of mPacked
+    std::vector<uint32_t> mRepackedLens;
+    std::vector<char> mReunpacked;
+    std::vector<size_t> mReunpackedOffsets;
+    uint64_t mNBases;
+    char const* mInFile;
 };
 
-void QualCompressor::configureBlocks( std::vector<uint8_t> const& quals )
+void RecordConverter::scan( char const* rec, uint32_t len, size_t alnNo )
 {
-    mBlocks.clear();
-    mCosts.clear();
-    mCosts.reserve(quals.size()+1);
-    mCosts.push_back(0); // cost of an empty compressed qual vector
-    auto beg = quals.begin();
-    auto end = quals.end();
-    auto itr = beg;
+    char const* inFile = mInFile;
+    BAMAlignHead aln;
+    uint32_t const HEAD_LEN = sizeof(aln) - sizeof(aln.mRemainingBlockSize);
+    if ( len < HEAD_LEN )
+        BAMERR(inFile," invalid alignment block size" << alnNo);
+    memcpy(reinterpret_cast<char*>(&aln)+sizeof(aln.mRemainingBlockSize),rec,HEAD_LEN);
+    uint64_t fixedLen = uint64_t(HEAD_LEN) + aln.mNameLen +
+                            aln.mCigarLen*sizeof(uint32_t) +
+                            (aln.mSeqLen + 1ul)/2 + aln.mSeqLen;
+    if ( fixedLen > len )
+        BAMERR(inFile," invalid alignment block size" << alnNo);
+
+    // QUAL is the last of the fixed-length fields.  a missing one is all 0xff.
+    QualCompressor::Recal recal;
+    char const* qual = rec + fixedLen - aln.mSeqLen;
+    if ( aln.mSeqLen && uint8_t(*qual) != 0xff )
+        recal = QualCompressor::Recal(qual,aln.mSeqLen);
+
+    char const* end = rec + len;
+    size_t nTags = mTags.size();
+    char const* itr = rec + fixedLen;
     while ( itr != end )
     {
-        uint8_t const MAX_Q = 63;
-        if ( *itr > MAX_Q )
-        {   std::cout << "\nYour input reads are funny.  I found a quality score of "
-                 << uint32_t(*itr) << ".\nThe maximum value that I allow is "
-                 << uint32_t(MAX_Q) << ".\n" << std::endl;
-            exit(1);    }
-
-        auto iCost = mCosts.end();
-        uint32_t minVal = uint32_t(*itr);
-        uint32_t maxVal = minVal;
-        uint32_t bits = 0;
-        uint32_t prevCost = *--iCost;
-        uint32_t nQs = 1;
-        uint32_t bestCost = prevCost + Block::blockSize(nQs,bits);
-        Block best(1,bits,minVal);
-        auto itr2 = itr;
-        ++itr;
-        while ( itr2 != beg && nQs < 255 )
+        if ( end - itr < 3 )
+            BAMERR(inFile," tag header truncated in alignment " << alnNo);
+        char const* tag = itr;
+        itr += 3;
+        if ( tag[0] == 'O' && tag[1] == 'Q' )
         {
-            unsigned val = *--itr2;
-            if ( val > maxVal )
-                maxVal = val;
-            if ( val < minVal )
-                minVal = val;
-            bits = ceilLg2(maxVal+1u-minVal);
-            prevCost = *--iCost;
-            unsigned curCost = prevCost + Block::blockSize(++nQs,bits);
-            if ( curCost < bestCost )
-            {
-                bestCost = curCost;
-                best = Block(nQs,bits,minVal);
-            }
+            if ( tag[2] != 'Z' )
+                BAMERR(inFile," contains OQ tag with non-Z data type in alignment " << alnNo);
+            if ( uint64_t(end - itr) < aln.mSeqLen + 1ul )
+                BAMERR(inFile," is truncated in OQ tag data in alignment " << alnNo);
+            if ( itr[aln.mSeqLen] )
+                BAMERR(inFile," contains OQ tag with the wrong length in alignment " << alnNo);
+
+            mOQs.push_back(itr);
+            mOQLens.push_back(aln.mSeqLen);
+            mOQRecals.push_back(recal);
+            itr += aln.mSeqLen + 1;
+            mTags.push_back(QualTag{tag,itr,alnNo,uint32_t(mOQs.size()-1),true});
+            continue;
         }
-        mCosts.push_back(bestCost);
-        unsigned toRemove = best.mNQs - 1;
-        if ( !toRemove )
-            mBlocks.push_back(best);
-        else
+
+        if ( tag[0] == 'Z' && tag[1] == 'Q' )
+        {
+            if ( tag[2] != 'B' )
+                BAMERR(inFile," contains a ZQ tag with non-B data type in alignment " << alnNo);
+            if ( end - itr < 5 )
+                BAMERR(inFile," ZQ tag size truncated in alignment " << alnNo);
+            if ( *itr++ != 'C' )
+                BAMERR(inFile," contains a ZQ tag with non-C data type in alignment " << alnNo);
+            uint32_t size;
+            memcpy(&size,itr,sizeof(size));
+            itr += sizeof(size);
+            if ( uint64_t(end - itr) < size )
+                BAMERR(inFile," ZQ tag data truncated in alignment " << alnNo);
+
+            mZQs.push_back(itr);
+            mZQLens.push_back(size);
+            mZQNQuals.push_back(aln.mSeqLen);
+            mZQRecals.push_back(recal);
+            itr += size;
+            mTags.push_back(QualTag{tag,itr,alnNo,uint32_t(mZQs.size()-1),false});
+            continue;
+        }
+
+        int tagLen = getTagLength(tag[2]);
+        if ( tagLen == -1 )
+            BAMERR(inFile," has bad data type in tag header in alignment " << alnNo);
+        if ( tag[2] == 'B' )
+        {
+            if ( end - itr < 5 )
+                BAMERR(inFile," is truncated in B tag header in alignment " << alnNo);
+            tagLen = getTagLength(*itr++);
+            if ( tagLen <= 0 )
+                BAMERR(inFile," has bad data type in B tag header in alignment " << alnNo);
+            uint32_t arrLen;
+            memcpy(&arrLen,itr,sizeof(arrLen));
+            itr += sizeof(arrLen);
+            if ( uint64_t(end - itr) < uint64_t(tagLen)*arrLen )
+                BAMERR(inFile," is truncated in tag data in alignment " << alnNo);
+            itr += uint64_t(tagLen)*arrLen;
+        }
+        else if ( tagLen )
+        {
+            if ( end - itr < tagLen )
+                BAMERR(inFile," is truncated in tag data in alignment " << alnNo);
+            itr += tagLen;
+        }
+        else // must be H or Z tag type
+        {
+            char const* nul = static_cast<char const*>(memchr(itr,0,end-itr));
+            if ( !nul )
+                BAMERR(inFile," is truncated in null-delimited tag data for alignment " << alnNo);
+            itr = nul + 1;
+        }
+    }
+    mRecords.push_back(Record{rec,end,mTags.size()-nTags});
+    mNBases += aln.mSeqLen;
+}
+
+void RecordConverter::countOQs( uint64_t* counts ) const
+{
+    for ( size_t idx = 0; idx != mOQs.size(); ++idx )
+    {
+        uint8_t const* itr = reinterpret_cast<uint8_t const*>(mOQs[idx]);
+        for ( uint8_t const* end = itr + mOQLens[idx]; itr != end; ++itr )
+            if ( uint8_t(*itr-33) <= QualDict::MAX_Q )
+                counts[uint8_t(*itr-33)] += 1;
+    }
+}
+
+void RecordConverter::verify()
+{
+    size_t nOQs = mOQs.size();
+    mRepacked.resize(nOQs);
+    mRepackedLens.resize(nOQs);
+    for ( size_t idx = 0; idx != nOQs; ++idx )
+    {
+        mRepacked[idx] = mPacked.data() + mPackedOffsets[idx];
+        mRepackedLens[idx] = mPackedOffsets[idx+1] - mPackedOffsets[idx];
+    }
+    mReunpacked.clear();
+    mVerifyQC.decode(mRepacked.data(),mRepackedLens.data(),mOQLens.data(),nOQs,33,
+                        mReunpacked,mReunpackedOffsets,mOQRecals.data());
+    for ( size_t idx = 0; idx != nOQs; ++idx )
+    {
+        size_t len = mReunpackedOffsets[idx+1] - mReunpackedOffsets[idx];
+        if ( len == mOQLens[idx] &&
+                !memcmp(mReunpacked.data()+mReunpackedOffsets[idx],mOQs[idx],len) )
+            continue;
+        size_t alnNo = 0;
+        for ( QualTag const& tag : mTags )
+            if ( tag.mIsOQ && tag.mIdx == idx )
+                alnNo = tag.mAlnNo;
+        BAMERR(mInFile," OQ tag in alignment " << alnNo
+                    << " doesn't unpack to what was packed:  the conversion isn't lossless");
+    }
+}
+
+void RecordConverter::convert( std::vector<char>& out )
+{
+    mPacked.clear();
+    mQC.encode(mOQs.data(),mOQLens.data(),mOQs.size(),33,mPacked,mPackedOffsets,
+                mOQRecals.data());
+    if ( mVerify )
+        verify();
+    mUnpacked.clear();
+    mQC.decode(mZQs.data(),mZQLens.data(),mZQNQuals.data(),mZQs.size(),33,mUnpacked,
+                mUnpackedOffsets,mZQRecals.data());
+    Stats::count(Stats::RECORDS,mRecords.size());
+    Stats::count(Stats::BASES,mNBases);
+    Stats::count(Stats::OQ_TAGS,mOQs.size());
+    Stats::count(Stats::OQ_BYTES_IN,std::accumulate(mOQLens.begin(),mOQLens.end(),0ul));
+    Stats::count(Stats::ZQ_BYTES_OUT,mPacked.size());
+    Stats::count(Stats::ZQ_TAGS,mZQs.size());
+    Stats::count(Stats::ZQ_BYTES_IN,std::accumulate(mZQLens.begin(),mZQLens.end(),0ul));
+    Stats::count(Stats::OQ_BYTES_OUT,mUnpacked.size());
+    Stats::Timer timer(Stats::ASSEMBLE);
+
+    // unchanged stretches are copied in one go, up to each OQ or ZQ tag, and
+    // then to the end of the record
+    mCRC = crc32(0,0,0);
+    mCRCLen = 0;
+    auto iTag = mTags.begin();
+    for ( Record const& record : mRecords )
+    {
+        size_t blockSizeIdx = out.size();
+        out.resize(blockSizeIdx+sizeof(uint32_t));
+        char const* copyFrom = record.mBeg;
+        bool hadZQ = false;
+        for ( auto tagEnd = iTag + record.mNTags; iTag != tagEnd; ++iTag )
         {
-            while ( toRemove > mBlocks.back().mNQs )
+            QualTag const& tag = *iTag;
+            append(out,copyFrom,tag.mBeg);
+            copyFrom = tag.mEnd;
+            hadZQ = hadZQ || !tag.mIsOQ;
+            if ( tag.mIsOQ )
             {
-                toRemove -= mBlocks.back().mNQs;
-                mBlocks.pop_back();
+                static char const ZQ_HEAD[] = "ZQBC";
+                append(out,ZQ_HEAD,ZQ_HEAD+4);
+                char const* packed = &mPacked[mPackedOffsets[tag.mIdx]];
+                uint32_t size = mPackedOffsets[tag.mIdx+1] - mPackedOffsets[tag.mIdx];
+                char const* pSize = reinterpret_cast<char const*>(&size);
+                append(out,pSize,pSize+sizeof(size));
+                append(out,packed,packed+size);
             }
-            if ( toRemove == mBlocks.back().mNQs )
-                mBlocks.back() = best;
             else
             {
-                mBlocks.back().mNQs -= toRemove;
-                mBlocks.push_back(best);
+                char const* quals = mUnpacked.data() + mUnpackedOffsets[tag.mIdx];
+                char const* qualsEnd = mUnpacked.data() + mUnpackedOffsets[tag.mIdx+1];
+                static char const OQ_HEAD[] = "OQZ";
+                append(out,OQ_HEAD,OQ_HEAD+3);
+                append(out,quals,qualsEnd);
+                out.push_back(0);
             }
         }
+        append(out,copyFrom,record.mEnd);
+
+        uint32_t blockSize = out.size() - blockSizeIdx - sizeof(blockSize);
+        memcpy(&out[blockSizeIdx],&blockSize,sizeof(blockSize));
+
+        if ( mVerify )
+        {
+            // the block size precedes the record's data in the input, too
+            char const* beg = hadZQ ? &out[blockSizeIdx] : record.mBeg - sizeof(blockSize);
+            char const* end = hadZQ ? out.data() + out.size() : record.mEnd;
+            mCRC = crc32(mCRC,reinterpret_cast<Bytef const*>(beg),end-beg);
+            mCRCLen += end - beg;
+        }
+    }
+
+    mRecords.clear();
+    mTags.clear();
+    mOQs.clear();
+    mOQLens.clear();
+    mOQRecals.clear();
+    mZQs.clear();
+    mZQLens.clear();
+    mZQNQuals.clear();
+    mZQRecals.clear();
+    mNBases = 0;
+}
+
+// a batch of consecutive alignments, in their on-disk format, and their
+// conversions.  each batch has its own RecordConverter, so batches can be
+// converted concurrently.
+struct Batch
+{
+    Batch( char const* inFile, CodecOptions const& opts )
+    : mConverter(inFile,opts), mFirstAlnNo(0), mNAlns(0) {}
+
+    void scan()
+    { Stats::Timer timer(Stats::PARSE);
+      char const* itr = mIn.data();
+      for ( size_t alnNo = mFirstAlnNo; alnNo != mFirstAlnNo+mNAlns; ++alnNo )
+      { uint32_t blockSize;
+        memcpy(&blockSize,itr,sizeof(blockSize));
+        itr += sizeof(blockSize);
+        mConverter.scan(itr,blockSize,alnNo);
+        itr += blockSize; } }
+
+    void convert()
+    { mOut.clear();
+      scan();
+      mConverter.convert(mOut); }
+
+    RecordConverter mConverter;
+    std::vector<char> mIn;
+    std::vector<char> mRaw; // the compressed block mIn came from, if it can be copied
+    std::vector<char> mOut;
+    size_t mFirstAlnNo;
+    size_t mNAlns;
+
+    static size_t const MAX_ALNS = 4096;
+    static size_t const MAX_BYTES = 4ul*1024ul*1024ul;
+};
+
+// appends the next alignment to a batch
+void readAlignment( std::istream& is, char const* inFile, size_t alnNo, Batch& batch )
+{
+    uint32_t blockSize;
+    if ( !is.read(reinterpret_cast<char*>(&blockSize),sizeof(blockSize)) )
+        BAMERR(inFile," is truncated in alignment header " << alnNo);
+    size_t idx = batch.mIn.size();
+    batch.mIn.resize(idx+sizeof(blockSize)+blockSize);
+    memcpy(&batch.mIn[idx],&blockSize,sizeof(blockSize));
+    if ( blockSize && !is.read(&batch.mIn[idx+sizeof(blockSize)],blockSize) )
+        BAMERR(inFile," is truncated in alignment " << alnNo);
+}
+
+// reads a batch of alignments.  returns false if there are none left.
+bool readBatch( std::istream& is, char const* inFile, size_t alnNo, Batch& batch )
+{
+    batch.mIn.clear();
+    batch.mRaw.clear();
+    batch.mFirstAlnNo = alnNo;
+    batch.mNAlns = 0;
+    while ( batch.mNAlns < Batch::MAX_ALNS && batch.mIn.size() < Batch::MAX_BYTES &&
+            is.peek() != std::istream::traits_type::eof() )
+    {
+        readAlignment(is,inFile,alnNo,batch);
+        alnNo += 1;
+        batch.mNAlns += 1;
+    }
+    return batch.mNAlns;
+}
+
+// reads batches like readBatch, except that an input block that holds nothing
+// but whole alignments, none of them with an OQ or ZQ tag, makes a batch of its
+// own.  its compressed form goes into the batch's mRaw, so that it can be
+// copied to the output without inflating and deflating it again.
+class BlockCopyingReader
+{
+public:
+    BlockCopyingReader( BAMistream& is, char const* inFile )
+    : mIS(is), mInFile(inFile), mCheckedAddr(~0ul), mNAlns(0) {}
+
+    // returns false if there are none left
+    bool readBatch( size_t alnNo, Batch& batch );
+
+private:
+    // the number of alignments in a block that can be copied, or 0
+    size_t countCopyable( BGZFInStreambuf::Block const& block );
+
+    BAMistream& mIS;
+    char const* mInFile;
+    uint64_t mCheckedAddr; // of the last block counted
+    size_t mNAlns; // and its count
+};
+
+bool BlockCopyingReader::readBatch( size_t alnNo, Batch& batch )
+{
+    batch.mIn.clear();
+    batch.mRaw.clear();
+    batch.mFirstAlnNo = alnNo;
+    batch.mNAlns = 0;
+    BGZFInStreambuf::Block block;
+    while ( batch.mNAlns < Batch::MAX_ALNS && batch.mIn.size() < Batch::MAX_BYTES &&
+            mIS.peek() != std::istream::traits_type::eof() )
+    {
+        if ( mIS.mSB.atBlockStart(block) && countCopyable(block) )
+        {
+            if ( batch.mNAlns )
+                break; // it'll be the next batch
+            batch.mIn.assign(block.mpData,block.mpData+block.mDataSize);
+            batch.mRaw.assign(block.mpBlock,block.mpBlock+block.mBlockSize);
+            batch.mNAlns = mNAlns;
+            mIS.mSB.skipBlock();
+            break;
+        }
+        readAlignment(mIS,mInFile,alnNo,batch);
+        alnNo += 1;
+        batch.mNAlns += 1;
+    }
+    return batch.mNAlns;
+}
+
+// tags are stored as their name and then their type, so a block with neither
+// "OQZ" nor "ZQB" anywhere in it has no OQ or ZQ tags.  (one that has them in
+// some other field is just not copied.)
+size_t BlockCopyingReader::countCopyable( BGZFInStreambuf::Block const& block )
+{
+    if ( block.mAddr == mCheckedAddr )
+        return mNAlns; // EARLY RETURN!
+    mCheckedAddr = block.mAddr;
+    mNAlns = 0;
+    char const* beg = block.mpData;
+    char const* end = beg + block.mDataSize;
+    if ( memmem(beg,end-beg,"OQZ",3) || memmem(beg,end-beg,"ZQB",3) )
+        return 0; // EARLY RETURN!
+    size_t nAlns = 0;
+    for ( char const* itr = beg; itr != end; ++nAlns )
+    {
+        uint32_t blockSize;
+        if ( size_t(end-itr) < sizeof(blockSize) )
+            return 0; // EARLY RETURN!
+        memcpy(&blockSize,itr,sizeof(blockSize));
+        itr += sizeof(blockSize);
+        if ( size_t(end-itr) < blockSize )
+            return 0; // EARLY RETURN!  the last alignment runs into the next block
+        itr += blockSize;
     }
+    mNAlns = nAlns;
+    return mNAlns;
 }
 
-std::vector<uint8_t>& QualCompressor::encode( std::vector<uint8_t> const& quals )
+// reads batches of just those alignments that overlap a region of a
+// coordinate-sorted BAM, seeking to them with the help of its index.
+// alignment numbers count only the alignments in the region.
+class RegionReader
 {
-    configureBlocks(quals);
+public:
+    RegionReader( BAMistream& is, char const* inFile, BAMIndex const& index,
+                    int32_t refID, int64_t beg, int64_t end )
+    : mIS(is), mInFile(inFile), mChunks(index.getChunks(refID,beg,end)), mChunkIdx(0),
+      mSeeking(true), mRefID(refID), mBeg(beg), mEnd(end)
+    {}
+
+    // returns false if there are none left
+    bool readBatch( size_t alnNo, Batch& batch );
 
-    mBuffer.reserve(quals.size());
-    mBuffer.clear();
-    auto itr = quals.begin();
-    for ( Block const& block : mBlocks )
+private:
+    BAMistream& mIS;
+    char const* mInFile;
+    std::vector<BAMIndex::Chunk> mChunks;
+    size_t mChunkIdx;
+    bool mSeeking;
+    int32_t mRefID;
+    int64_t mBeg;
+    int64_t mEnd;
+};
+
+bool RegionReader::readBatch( size_t alnNo, Batch& batch )
+{
+    batch.mIn.clear();
+    batch.mRaw.clear();
+    batch.mFirstAlnNo = alnNo;
+    batch.mNAlns = 0;
+    while ( batch.mNAlns < Batch::MAX_ALNS && batch.mIn.size() < Batch::MAX_BYTES &&
+            mChunkIdx != mChunks.size() )
     {
-        uint64_t nQs = block.mNQs;
-        uint64_t nBits = block.mBits;
-        uint64_t minQ = block.mMinQ;
-        mBuffer.push_back(nQs);
-        uint64_t bits = nBits;
-        bits |= minQ << 3;
-        mBuffer.push_back(bits);
-        bits >>= 8;
-        if ( !nBits )
+        BAMIndex::Chunk const& chunk = mChunks[mChunkIdx];
+        if ( mSeeking )
         {
-            mBuffer.push_back(bits);
-            itr += nQs;
+            mIS.clear();
+            if ( !mIS.mSB.virtualSeek(chunk.mBeg) )
+                BAMERR(mInFile," can't seek to an offset given by its index");
+            mSeeking = false;
         }
-        else
+        if ( mIS.mSB.virtualTell() >= chunk.mEnd )
         {
-            uint64_t off = 1;
-            while ( nQs-- )
-            {
-                uint64_t val = *itr - minQ;
-                ++itr;
-                bits |= val << off;
-                if ( (off += nBits) >= 8 )
-                {
-                    mBuffer.push_back(bits);
-                    off -= 8;
-                    bits >>= 8;
-                }
-            }
-            if ( off )
-                mBuffer.push_back(bits);
+            mChunkIdx += 1;
+            mSeeking = true;
+            continue;
+        }
+
+        size_t idx = batch.mIn.size();
+        readAlignment(mIS,mInFile,alnNo,batch);
+        BAMAlignHead aln;
+        uint32_t const HEAD_LEN = sizeof(aln) - sizeof(aln.mRemainingBlockSize);
+        char const* rec = &batch.mIn[idx+sizeof(aln.mRemainingBlockSize)];
+        uint32_t len = batch.mIn.size() - idx - sizeof(aln.mRemainingBlockSize);
+        if ( len < HEAD_LEN )
+            BAMERR(mInFile," alignment " << alnNo << " is too short");
+        memcpy(reinterpret_cast<char*>(&aln)+sizeof(aln.mRemainingBlockSize),rec,HEAD_LEN);
+
+        // the alignments are sorted, so once past the region, we're done
+        if ( aln.mRefID < 0 || aln.mRefID > mRefID ||
+                (aln.mRefID == mRefID && aln.mPos >= mEnd) )
+        {
+            batch.mIn.resize(idx);
+            mChunkIdx = mChunks.size();
+            break;
         }
+        if ( aln.mRefID < mRefID || getRefEnd(aln,rec,len) <= mBeg )
+        {
+            batch.mIn.resize(idx);
+            continue;
+        }
+        alnNo += 1;
+        batch.mNAlns += 1;
     }
-    mBuffer.push_back(0);
-    return mBuffer;
+    return batch.mNAlns;
 }
 
-std::vector<uint8_t>& QualCompressor::decode( std::vector<uint8_t> const& packedQuals )
+// a CRC32 of a file's alignment records in their OQ form, combined batch by
+// batch, in file order
+struct RecordChecksum
 {
-    mBuffer.reserve(4*packedQuals.size());
-    mBuffer.clear();
-    if ( packedQuals.empty() )
-        return mBuffer;
-    uint64_t addr = reinterpret_cast<uint64_t>(&packedQuals[0]);
-    uint64_t* buf = reinterpret_cast<uint64_t*>(addr&~7);
-    uint64_t bits = *buf++;
-    addr = (addr & 7) << 3;
-    uint64_t remain = 64 - addr;
-    bits >>= addr;
-    uint64_t nQs;
-    while ( (nQs = bits&0xff) )
+    RecordChecksum() : mCRC(crc32(0,0,0)), mLen(0) {}
+    void add( uint32_t crc, uint64_t len )
+    { mCRC = crc32_combine(mCRC,crc,len); mLen += len; }
+    uint32_t mCRC;
+    uint64_t mLen;
+};
+
+// writes a batch's converted alignments, and notes them in the index and the
+// checksum, if any.  a batch from a block that can be copied, and that's come
+// through conversion unchanged, is written as the block it came from.
+void writeBatch( BAMostream& os, char const* outFile, Batch const& batch,
+                    BAMIndexer* pIndexer, RecordChecksum* pChecksum )
+{
+    if ( pChecksum )
+        pChecksum->add(batch.mConverter.getCRC(),batch.mConverter.getCRCLen());
+    if ( pIndexer )
     {
-        bits >>= 8;
-        if ( !(remain -= 8) )
+        uint64_t base = os.tellp();
+        char const* beg = batch.mOut.data();
+        char const* end = beg + batch.mOut.size();
+        for ( char const* itr = beg; itr != end; )
         {
-            bits = *buf++;
-            remain = 64;
+            uint32_t blockSize;
+            memcpy(&blockSize,itr,sizeof(blockSize));
+            char const* next = itr + sizeof(blockSize) + blockSize;
+            pIndexer->add(itr+sizeof(blockSize),blockSize,base+(itr-beg),base+(next-beg));
+            itr = next;
         }
-        uint64_t nBits = bits & 0x07;
-        bits >>= 3;
-        uint64_t minQ = bits & 0x3f;
-        bits >>= 6;
-        if ( remain < 9 )
+    }
+    if ( !batch.mRaw.empty() && batch.mOut == batch.mIn )
+        os.mSB.copyBlock(batch.mRaw.data(),batch.mRaw.size(),batch.mOut.size());
+    else if ( os.mSB.isRecordAligned() )
+    {
+        // one at a time, marking where each ends
+        char const* end = batch.mOut.data() + batch.mOut.size();
+        for ( char const* itr = batch.mOut.data(); itr != end; )
         {
-            bits = *buf++;
-            minQ |= (bits & 1) << 5;
-            bits >>= 1;
-            remain += 64;
+            uint32_t blockSize;
+            memcpy(&blockSize,itr,sizeof(blockSize));
+            char const* next = itr + sizeof(blockSize) + blockSize;
+            if ( !os.write(itr,next-itr) )
+                BAMERR(outFile," alignment data in alignments " << batch.mFirstAlnNo << '-'
+                            << batch.mFirstAlnNo+batch.mNAlns-1 << " unwritable");
+            os.mSB.markBoundary();
+            itr = next;
         }
-        remain -= 9;
-        if ( !nBits )
-            while ( nQs-- )
-                mBuffer.push_back(minQ);
-        else
+    }
+    else if ( !batch.mOut.empty() && !os.write(batch.mOut.data(),batch.mOut.size()) )
+        BAMERR(outFile," alignment data in alignments " << batch.mFirstAlnNo << '-'
+                    << batch.mFirstAlnNo+batch.mNAlns-1 << " unwritable");
+    if ( pIndexer )
+        pIndexer->resolve(os.mSB);
+}
+
+// converts all the alignments in a pipeline:  this thread reads batches of
+// alignments, the pool's workers convert them, and a writer thread writes them
+// in their original order.  the number of batches is fixed, which caps memory
+// use -- the reader waits for the writer to finish with a batch before reusing
+// it.  without any pool threads, everything happens on this thread.
+// read is called to fill each batch, given the number of its first alignment,
+// and returns false when there are no more.
+// returns the fast-mode sample, summed over all the batches.
+typedef std::function<bool( size_t alnNo, Batch& batch )> BatchReader;
+QualCompressor::Sample convertAlignments( BatchReader const& read, BAMostream& os,
+                                            ThreadPool& pool, CodecOptions const& opts,
+                                            BAMIndexer* pIndexer, RecordChecksum* pChecksum,
+                                            char const* inFile, char const* outFile )
+{
+    size_t alnNo = 0;
+    if ( !pool.size() )
+    {
+        Batch batch(inFile,opts);
+        while ( read(alnNo,batch) )
         {
-            uint64_t mask = (1ul<<nBits)-1ul;
-            while ( nQs-- )
-            {
-                uint64_t val = bits;
-                uint64_t used = nBits;
-                if ( remain < nBits )
-                {
-                    bits = *buf++;
-                    val |= bits << remain;
-                    used -= remain;
-                    remain += 64;
-                }
-                remain -= nBits;
-                bits >>= used;
-                mBuffer.push_back(minQ + (val & mask));
-            }
+            batch.convert();
+            writeBatch(os,outFile,batch,pIndexer,pChecksum);
+            alnNo += batch.mNAlns;
         }
-        bits >>= remain & 7;
-        remain &= ~7ul;
-        if ( !remain )
+        return batch.mConverter.getSample(); // EARLY RETURN!
+    }
+
+    size_t nBatches = 2*pool.size() + 2;
+    std::vector<std::unique_ptr<Batch>> batches;
+    BoundedQueue<Batch*> idle(nBatches);
+    for ( size_t idx = 0; idx != nBatches; ++idx )
+    {
+        batches.emplace_back(new Batch(inFile,opts));
+        idle.push(batches.back().get());
+    }
+
+    // an error in converting or writing a batch stops the writer writing, and
+    // closing idle stops the reader.  the error's rethrown here.  either way,
+    // every batch submitted is waited for before the batches go away.
+    typedef std::pair<Batch*,std::future<void>> Work;
+    BoundedQueue<Work> converting(nBatches);
+    std::exception_ptr pWriteErr;
+    std::thread writer([&]
+    { Work work;
+      while ( converting.pop(work) )
+      { try
+        { work.second.get();
+          if ( pWriteErr )
+              continue;
+          writeBatch(os,outFile,*work.first,pIndexer,pChecksum);
+          idle.push(work.first); }
+        catch ( ... )
+        { if ( !pWriteErr )
+              pWriteErr = std::current_exception();
+          idle.close(); } } });
+
+    try
+    {
+        Batch* pBatch;
+        while ( idle.pop(pBatch) && read(alnNo,*pBatch) )
         {
-            bits = *buf++;
-            remain = 64;
+            alnNo += pBatch->mNAlns;
+            converting.push(Work(pBatch,pool.submit([pBatch]{ pBatch->convert(); })));
         }
     }
-    return mBuffer;
+    catch ( ... )
+    {
+        converting.close();
+        writer.join();
+        throw;
+    }
+    converting.close();
+    writer.join();
+    if ( pWriteErr )
+        std::rethrow_exception(pWriteErr);
+
+    QualCompressor::Sample sample;
+    for ( auto const& batch : batches )
+        sample += batch->mConverter.getSample();
+    return sample;
 }
 
-int main( int argc, char** argv )
+void usage()
+{
+    std::cerr << "Usage: OQCompress [-@ nThreads] [-l level] [-s strategy] [--fast] [--delta]\n"
+                 "                  [--rans] [--dict] [--stats file [--stats-interval secs]]\n"
+                 "                  [--verify] [--copy-blocks] [--aligned-blocks] [--bai] [--csi]\n"
+                 "                  [-r region] in.bam out.bam\n"
+                 "       OQCompress [options] --manifest file [-j nFiles]\n"
+                 "  in.bam or out.bam may be -, for standard input or output.\n"
+                 "  -@ nThreads  number of worker threads for quality conversion and BGZF\n"
+                 "               compression and decompression (default 0)\n"
+                 "  -l level     output compression level, 0..9 (default 6).  level 0 writes\n"
+                 "               uncompressed BGZF blocks, which is cheapest for piping into\n"
+                 "               another tool.\n"
+                 "  -s strategy  deflate strategy: default, filtered, huffman, rle, or fixed\n"
+                 "  --fast       choose quality blocks greedily rather than optimally.  the\n"
+                 "               ZQ tags are a little bigger, and decode just the same.  a\n"
+                 "               sample of reads is also packed optimally, to report how\n"
+                 "               much bigger.\n"
+                 "  --delta      pack OQ as its difference from QUAL for reads where that's\n"
+                 "               smaller.  reads are partitioned twice, so it's slower.\n"
+                 "               ZQ tags packed this way need the read's QUAL to unpack.\n"
+                 "  --rans       entropy code OQ with order-0 or order-1 rANS for reads where\n"
+                 "               that's smaller.  it pays for long reads and binned quals.\n"
+                 "  --verify     unpack each ZQ tag as it's packed, and exit with an error if\n"
+                 "               it doesn't match its OQ tag.  also reports a CRC32 of the\n"
+                 "               alignments in their OQ form, which is the same for a file\n"
+                 "               and its conversion, whichever way it went.\n"
+                 "  --dict       rank the distinct quals of the first few thousand reads, and\n"
+                 "               pack reads as ranks where that's smaller.  for binned quals.\n"
+                 "               the ranking is kept in the output's header, as an @CO line.\n"
+                 "  --copy-blocks  copy input blocks that hold only whole alignments with\n"
+                 "               no OQ or ZQ tags to the output as they are, without\n"
+                 "               inflating and deflating them again.  they keep the input's\n"
+                 "               compression.  ignored with -r.\n"
+                 "  --aligned-blocks  end output blocks only between alignments (unless one\n"
+                 "               is too big for a block), so that each block can be parsed\n"
+                 "               on its own, and copied by --copy-blocks in later runs\n"
+                 "  --stats file  write counters and per-stage times to file as JSON when\n"
+                 "               done.  stage times are summed over threads.\n"
+                 "  --stats-interval secs  also write them every secs seconds, one JSON\n"
+                 "               object per line.  the last one has \"final\":true.\n"
+                 "  --bai        write a BAI index, out.bam.bai, for coordinate-sorted input\n"
+                 "  --csi        write a CSI index, out.bam.csi, which also copes with\n"
+                 "               references too long for a BAI\n"
+                 "  -r region    convert only the alignments overlapping region, given as\n"
+                 "               ref, ref:beg, or ref:beg-end (1-based, inclusive).  in.bam\n"
+                 "               must be coordinate-sorted and have an index:  in.bam.bai,\n"
+                 "               in.bam.csi, or in.bai.\n"
+                 "  --manifest file  convert each pair of files listed in file, an input\n"
+                 "               and an output BAM per line, biggest inputs first.  a line\n"
+                 "               of status, OK or FAIL, is written for each as it's\n"
+                 "               finished.  a failed file's output is removed, the rest\n"
+                 "               carry on, and the exit status is 1.\n"
+                 "  -j nFiles    convert this many of the manifest's files at once, all\n"
+                 "               sharing the -@ threads (default 1 + nThreads/4)"
+              << std::endl;
+    exit(1);
+}
+
+int getStrategy( char const* name )
 {
-    if ( argc != 3 )
+    static struct { char const* mName; int mStrategy; } const STRATEGIES[] =
+    { {"default",Z_DEFAULT_STRATEGY}, {"filtered",Z_FILTERED},
+      {"huffman",Z_HUFFMAN_ONLY}, {"rle",Z_RLE}, {"fixed",Z_FIXED} };
+    for ( auto const& entry : STRATEGIES )
+        if ( !strcmp(name,entry.mName) )
+            return entry.mStrategy;
+    usage();
+    return Z_DEFAULT_STRATEGY;
+}
+
+// parses a region into a reference name and a zero-based, half-open interval.
+// if what follows the last colon isn't a range, the whole thing is a name.
+void parseRegion( char const* region, std::string& refName, int64_t& beg, int64_t& end )
+{
+    refName = region;
+    beg = 0;
+    end = INT64_MAX;
+    char const* colon = strrchr(region,':');
+    if ( !colon || !colon[1] )
+        return; // EARLY RETURN!
+
+    char* itr;
+    long long val = strtoll(colon+1,&itr,10);
+    if ( itr == colon+1 || val < 1 )
+        return; // EARLY RETURN!
+    int64_t newBeg = val - 1;
+    int64_t newEnd = INT64_MAX;
+    if ( *itr == '-' )
     {
-        std::cout << "Usage: OQCompress in.bam out.bam" << std::endl;
-        exit(1);
+        char* last;
+        val = strtoll(itr+1,&last,10);
+        if ( last == itr+1 || val <= newBeg )
+            usage();
+        newEnd = val;
+        itr = last;
     }
-    char const* inFile = argv[1];
-    char const* outFile = argv[2];
-    igzstream is(inFile);
-    BAMostream os(outFile);
-
-    // copy header
-    std::vector<char> buffer;
-    buffer.reserve(2048);
+    if ( *itr )
+        return; // EARLY RETURN!
+    refName.assign(region,colon);
+    beg = newBeg;
+    end = newEnd;
+}
+
+// the index for a BAM:  file.bai, file.csi, or the BAM's name with .bai in
+// place of its .bam suffix
+std::string findIndex( char const* bamFile )
+{
+    std::string name(bamFile);
+    std::string candidates[] = { name+".bai", name+".csi", "" };
+    if ( name.size() > 4 && !name.compare(name.size()-4,4,".bam") )
+        candidates[2] = name.substr(0,name.size()-4) + ".bai";
+    for ( std::string const& candidate : candidates )
+        if ( !candidate.empty() && !access(candidate.c_str(),R_OK) )
+            return candidate; // EARLY RETURN!
+    throw std::runtime_error("Can't find an index for " + name);
+}
+
+// converts one file.  the codec options are copied, since the qual
+// dictionaries are the file's own.  returns the fast-mode sample.  throws
+// std::runtime_error if the file can't be converted.
+QualCompressor::Sample convertFile( char const* inFile, char const* outFile, ThreadPool& pool,
+                                    FileOptions const& fileOpts )
+{
+    CodecOptions opts = fileOpts.mCodecs;
+    BAMistream is(inFile,&pool);
+    BAMostream os(outFile,&pool,fileOpts.mLevel,fileOpts.mStrategy);
+    os.mSB.setRecordAligned(fileOpts.mAlignedBlocks);
+
+    // read the header.  it's written once we know whether it's to get a qual
+    // dictionary.
     uint32_t val;
     if ( !is.read(reinterpret_cast<char*>(&val),sizeof(val)) )
         BAMERR(inFile," is empty");
     if ( val != 0x014d4142 )
         BAMERR(inFile," lacks a BAM header");
-    if ( !os.write(reinterpret_cast<char const*>(&val),sizeof(val)) )
-        BAMERR(outFile," is unwritable");
     if ( !is.read(reinterpret_cast<char*>(&val),sizeof(val)) )
         BAMERR(inFile," header length is truncated");
-    if ( !os.write(reinterpret_cast<char const*>(&val),sizeof(val)) )
-        BAMERR(outFile," header length unwritable");
-    buffer.resize(val);
-    if ( !is.read(&buffer[0],val) )
+    std::string text(val,'\0');
+    if ( val && !is.read(&text[0],val) )
         BAMERR(inFile," header is truncated");
-    if ( !os.write(&buffer[0],val) )
-        BAMERR(outFile," header unwritable");
 
-    // copy reference dictionary
+    // read reference dictionary
+    std::vector<char> refDict;
+    std::vector<uint32_t> refLens;
+    std::vector<std::string> refNames;
     uint32_t nRefs;
     if ( !is.read(reinterpret_cast<char*>(&nRefs),sizeof(nRefs)) )
         BAMERR(inFile," is truncated at ref desc count");
-    if ( !os.write(reinterpret_cast<char const*>(&nRefs),sizeof(nRefs)) )
-        BAMERR(outFile," ref desc count unwritable");
-    while ( nRefs-- )
+    for ( uint32_t refNo = 0; refNo != nRefs; ++refNo )
     {
         if ( !is.read(reinterpret_cast<char*>(&val),sizeof(val)) )
             BAMERR(inFile," is truncated in ref desc len");
-        if ( !os.write(reinterpret_cast<char*>(&val),sizeof(val)) )
-            BAMERR(outFile," ref desc len unwritable");
-        buffer.resize(val);
-        if ( !is.read(&buffer[0],val) )
+        size_t idx = refDict.size();
+        refDict.resize(idx+sizeof(val)+val+sizeof(uint32_t));
+        memcpy(&refDict[idx],&val,sizeof(val));
+        char* name = &refDict[idx+sizeof(val)];
+        if ( !is.read(name,val) )
             BAMERR(inFile," ref desc name is truncated");
-        if ( !os.write(&buffer[0],val) )
-            BAMERR(outFile," ref desc name unwritable");
+        refNames.push_back(std::string(name,strnlen(name,val)));
         if ( !is.read(reinterpret_cast<char*>(&val),sizeof(val)) )
             BAMERR(inFile," is truncated in ref desc size");
-        if ( !os.write(reinterpret_cast<char const*>(&val),sizeof(val)) )
-            BAMERR(outFile," ref desc size unwritable");
+        memcpy(&refDict[refDict.size()-sizeof(val)],&val,sizeof(val));
+        refLens.push_back(val);
     }
 
-    BAMAlignHead aln;
-    QualCompressor qc;
-    size_t alnNo = 0;
-    while ( is.peek() != std::istream::traits_type::eof() )
+    std::unique_ptr<BAMIndexer> pIndexer;
+    if ( fileOpts.mBAI || fileOpts.mCSI )
+    {
+        pIndexer.reset(new BAMIndexer(refLens));
+        os.mSB.setTrackOffsets(true);
+    }
+    BatchReader read = [&]( size_t alnNo, Batch& batch )
+                        { return readBatch(is,inFile,alnNo,batch); };
+    std::unique_ptr<BAMIndex> pIndex;
+    std::unique_ptr<RegionReader> pRegionReader;
+    std::unique_ptr<BlockCopyingReader> pCopyingReader;
+    if ( fileOpts.mCopyBlocks && !fileOpts.mpRegion )
+    {
+        pCopyingReader.reset(new BlockCopyingReader(is,inFile));
+        read = [&]( size_t alnNo, Batch& batch )
+                { return pCopyingReader->readBatch(alnNo,batch); };
+    }
+    if ( fileOpts.mpRegion )
+    {
+        std::string refName;
+        int64_t beg, end;
+        parseRegion(fileOpts.mpRegion,refName,beg,end);
+        auto itr = std::find(refNames.begin(),refNames.end(),refName);
+        if ( itr == refNames.end() )
+            throw std::runtime_error(std::string("Region ") + fileOpts.mpRegion +
+                                        " names a reference that isn't in " + inFile);
+        pIndex.reset(new BAMIndex(findIndex(inFile).c_str()));
+        pRegionReader.reset(new RegionReader(is,inFile,*pIndex,itr-refNames.begin(),beg,end));
+        read = [&]( size_t alnNo, Batch& batch )
+                { return pRegionReader->readBatch(alnNo,batch); };
+    }
+
+    // the input's qual dictionary, if any, is for unpacking its ZQ tags.  with
+    // --dict, a new one is made from the first batch of alignments for the ZQ
+    // tags we write.
+    QualDict decodeDict;
+    QualDict encodeDict;
+    decodeDict.extractFrom(text);
+    if ( !decodeDict.empty() )
+        opts.mpDecodeDict = &decodeDict;
+    std::vector<char> sampleIn;
+    size_t nSampleAlns = 0;
+    BatchReader readRest = read;
+    if ( fileOpts.mDict )
     {
-        std::ostringstream oss;
-        if ( !is.read(reinterpret_cast<char*>(&aln),sizeof(aln)) )
-            BAMERR(inFile," is truncated in alignment header " << alnNo);
-        buffer.resize(aln.mNameLen);
-        if ( !is.read(&buffer[0],aln.mNameLen) )
-            BAMERR(inFile," is truncated in read name " << alnNo);
-        if ( !oss.write(&buffer[0],aln.mNameLen) )
-            BAMERR(outFile," read name " << alnNo << " unwritable");
-        val = aln.mCigarLen*sizeof(uint32_t);
-        int32_t auxLen = aln.mRemainingBlockSize -
-                                sizeof(aln) + sizeof(aln.mRemainingBlockSize) -
-                                aln.mNameLen - val;
-        buffer.resize(val);
-        if ( !is.read(&buffer[0],val) )
-            BAMERR(inFile," is truncated in cigar" << alnNo);
-        if ( !oss.write(&buffer[0],val) )
-            BAMERR(outFile," cigar " << alnNo << " unwritable");
-        val = (aln.mSeqLen + 1)/2;
-        auxLen -= val + aln.mSeqLen;
-        if ( auxLen < 0 )
-            BAMERR(inFile," invalid alignment block size" << alnNo);
-        buffer.resize(val);
-        if ( !is.read(&buffer[0],val) )
-            BAMERR(inFile," sequence " << alnNo << " is truncated ");
-        if ( !oss.write(&buffer[0],val) )
-            BAMERR(outFile," sequence " << alnNo << " unwritable");
-        buffer.resize(aln.mSeqLen);
-        if ( !is.read(&buffer[0],aln.mSeqLen) )
-            BAMERR(inFile," quals " << alnNo << " truncated");
-        if ( !oss.write(&buffer[0],aln.mSeqLen) )
-            BAMERR(outFile," quals " << alnNo << " unwritable");
-        while ( auxLen > 0 )
+        Batch sample(inFile,opts);
+        if ( read(0,sample) )
         {
-            char tag[3];
-            if ( !is.read(tag,sizeof(tag)) )
-                BAMERR(inFile," tag header truncated in alignment " << alnNo);
-            if ( tag[0] == 'O' && tag[1] == 'Q' )
+            uint64_t counts[QualDict::MAX_Q+1] = {};
+            sample.scan();
+            sample.mConverter.countOQs(counts);
+            encodeDict.build(counts);
+            // it's only worth having if there are gaps between the quals
+            if ( !encodeDict.empty() &&
+                    encodeDict.size() < encodeDict.qual(encodeDict.size()-1) -
+                                            encodeDict.qual(0) + 1u )
             {
-                if ( tag[2] != 'Z' )
-                    BAMERR(inFile," contains OQ tag with non-Z data type in alignment " << alnNo);
-                buffer.resize(aln.mSeqLen);
-                if ( !is.read(&buffer[0],aln.mSeqLen) )
-                    BAMERR(inFile," is truncated in OQ tag data in alignment " << alnNo);
-                char byte;
-                if ( !is.get(byte) || byte )
-                    BAMERR(inFile," contains OQ tag with the wrong length in alignment " << alnNo);
-
-                for ( char& val : buffer )
-                    val -= 33;
-
-                std::vector<uint8_t> const& byteBuf = *reinterpret_cast<std::vector<uint8_t> const*>(&buffer);
-                std::vector<uint8_t> const& packedQuals = qc.encode(byteBuf);
-                if ( !oss.write("ZQBC",4) )
-                    BAMERR(outFile," ZQ tag header unwritable in alignment " << alnNo);
-                uint32_t size = packedQuals.size();
-                if ( !oss.write(reinterpret_cast<char const*>(&size),sizeof(size)) )
-                    BAMERR(outFile," ZQ tag length unwritable in alignment " << alnNo);
-                if ( size && !oss.write(reinterpret_cast<char const*>(&packedQuals[0]),size) )
-                    BAMERR(outFile," ZQ tag contents unwritable in alignment " << alnNo);
-
-                auxLen -= aln.mSeqLen + 1 + 3;
-                continue;
+                opts.mpEncodeDict = &encodeDict;
+                encodeDict.insertInto(text);
             }
+            sampleIn.swap(sample.mIn);
+            nSampleAlns = sample.mNAlns;
+            read = [&]( size_t alnNo, Batch& batch )
+                    { if ( !nSampleAlns ) return readRest(alnNo,batch);
+                      batch.mIn.swap(sampleIn);
+                      batch.mRaw.clear();
+                      batch.mFirstAlnNo = alnNo;
+                      batch.mNAlns = nSampleAlns;
+                      nSampleAlns = 0;
+                      return true; };
+        }
+    }
 
-            if ( tag[0] == 'Z' && tag[1] == 'Q' )
-            {
-                if ( tag[2] != 'B' )
-                    BAMERR(inFile," contains a ZQ tag with non-B data type in alignment " << alnNo);
-                char dataType;
-                if ( !is.get(dataType) || dataType != 'C' )
-                    BAMERR(inFile," contains a ZQ tag with non-C data type in alignment " << alnNo);
-                uint32_t size;
-                if ( !is.read(reinterpret_cast<char*>(&size),sizeof(size)) )
-                    BAMERR(inFile," ZQ tag size truncated in alignment " << alnNo);
-                buffer.resize(size);
-                if ( !is.read(&buffer[0],size) )
-                    BAMERR(inFile," ZQ tag data truncated in alignment " << alnNo);
-                std::vector<uint8_t> const& byteBuf = *reinterpret_cast<std::vector<uint8_t> const*>(&buffer);
-                std::vector<uint8_t>& quals = qc.decode(byteBuf);
-                if ( quals.size() != aln.mSeqLen )
-                    BAMERR(inFile," unpacked ZQ tag has wrong size in alignment " << alnNo);
-
-                for ( uint8_t& val : quals )
-                    val += 33;
-
-                if ( !oss.write("OQZ",3) )
-                    BAMERR(outFile," OQ tag header unwritable in alignment " << alnNo);
-                if ( !oss.write(reinterpret_cast<char const*>(&quals[0]),quals.size()) )
-                    BAMERR(outFile," OQ tag data unwritable in alignment " << alnNo);
-                if ( !oss.put(0) )
-                    BAMERR(outFile," OQ tag null unwritable in alignment " << alnNo);
-
-                auxLen -= size + 4 + 4;
-                continue;
-            }
+    // write the header
+    val = 0x014d4142;
+    if ( !os.write(reinterpret_cast<char const*>(&val),sizeof(val)) )
+        BAMERR(outFile," is unwritable");
+    val = text.size();
+    if ( !os.write(reinterpret_cast<char const*>(&val),sizeof(val)) )
+        BAMERR(outFile," header length unwritable");
+    if ( !os.write(text.data(),text.size()) )
+        BAMERR(outFile," header unwritable");
+    if ( !os.write(reinterpret_cast<char const*>(&nRefs),sizeof(nRefs)) )
+        BAMERR(outFile," ref desc count unwritable");
+    if ( !os.write(refDict.data(),refDict.size()) )
+        BAMERR(outFile," ref desc unwritable");
+    os.mSB.markBoundary();
 
-            if ( !oss.write(tag,sizeof(tag)) )
-                BAMERR(outFile," tag header unwritable in alignment " << alnNo);
-            auxLen -= 3;
-            int tagLen = getTagLength(tag[2]);
-            if ( tagLen == -1 )
-                BAMERR(inFile," has bad data type in tag header in alignment " << alnNo);
-            if ( tag[2] == 'B' )
-            {
-                char dataType;
-                uint32_t arrLen;
-                if ( !is.get(dataType) ||
-                     !is.read(reinterpret_cast<char*>(&arrLen),sizeof(arrLen)) )
-                    BAMERR(inFile," is truncated in B tag header in alignment " << alnNo);
-                if ( !oss.put(dataType) ||
-                     !oss.write(reinterpret_cast<char const*>(&arrLen),sizeof(arrLen)) )
-                    BAMERR(outFile," B tag header unwritable in alignment " << alnNo);
-                tagLen = getTagLength(dataType);
-                if ( tagLen <= 0 )
-                    BAMERR(inFile," has bad data type in B tag header in alignment " << alnNo);
-                tagLen *= arrLen;
-                auxLen -= 5;
-            }
+    RecordChecksum checksum;
+    QualCompressor::Sample sample =
+            convertAlignments(read,os,pool,opts,pIndexer.get(),
+                                opts.mVerify ? &checksum : 0,inFile,outFile);
+    // a failed read looks just like the end of the file to the stream
+    if ( is.mFilebuf.failed() )
+        BAMERR(inFile," couldn't be read to the end");
+    // the virtual offsets for the index aren't known until everything's been
+    // written, and write errors don't show up until the file's closed
+    os.close();
+    if ( pIndexer )
+    {
+        std::string outName(outFile);
+        if ( pIndexer->getProblem() )
+            std::cerr << "No index written for " << outFile << " because "
+                      << pIndexer->getProblem() << '.' << std::endl;
+        else
+        {
+            if ( fileOpts.mBAI && !pIndexer->canWriteBAI() )
+                std::cerr << "No BAI written for " << outFile << " because a reference is"
+                             " too long.  Use --csi instead." << std::endl;
+            else if ( fileOpts.mBAI )
+                pIndexer->writeBAI((outName+".bai").c_str(),os.mSB);
+            if ( fileOpts.mCSI )
+                pIndexer->writeCSI((outName+".csi").c_str(),os.mSB);
+        }
+    }
+    if ( opts.mVerify )
+        std::cerr << "Verified " << inFile << " -> " << outFile << ":  OQ-form records CRC32 "
+                  << std::hex << std::setw(8) << std::setfill('0') << checksum.mCRC
+                  << std::dec << std::setfill(' ') << " over " << checksum.mLen
+                  << " bytes" << std::endl;
+    return sample;
+}
 
-            if ( tagLen )
-            {
-                buffer.resize(tagLen);
-                if ( !is.read(&buffer[0],tagLen) )
-                    BAMERR(inFile," is truncated in tag data in alignment " << alnNo);
-                if ( !oss.write(&buffer[0],tagLen) )
-                    BAMERR(outFile," tag data in alignment " << alnNo << " unwritable");
-                auxLen -= tagLen;
-            }
-            else // must be H or Z tag type
-            {
-                char byte;
-                do
-                {
-                    if ( !is.get(byte) )
-                        BAMERR(inFile," is truncated in null-delimited tag data for alignment " << alnNo);
-                    if ( !oss.put(byte) )
-                        BAMERR(outFile," null-delimited tag data in alignment " << alnNo << " unwritable");
-                    auxLen -= 1;
-                } while ( byte );
-            }
+typedef std::pair<std::string,std::string> FilePair; // input and output
+
+// a manifest has an input and an output BAM on each line, separated by white
+// space.  blank lines, and lines that start with #, are skipped.
+std::vector<FilePair> readManifest( char const* manifest )
+{
+    std::ifstream in(manifest);
+    if ( !in )
+    {
+        std::cerr << "Can't open manifest " << manifest << std::endl;
+        exit(1);
+    }
+    std::vector<FilePair> pairs;
+    std::string line;
+    for ( size_t lineNo = 1; std::getline(in,line); ++lineNo )
+    {
+        std::istringstream iss(line);
+        FilePair files;
+        std::string extra;
+        if ( !(iss >> files.first) || files.first[0] == '#' )
+            continue;
+        if ( !(iss >> files.second) || (iss >> extra) ||
+                files.first == "-" || files.second == "-" )
+        {
+            std::cerr << "Line " << lineNo << " of manifest " << manifest
+                      << " isn't an input and an output file name." << std::endl;
+            exit(1);
+        }
+        pairs.push_back(files);
+    }
+    return pairs;
+}
+
+// converts the files in a manifest, nAtOnce at a time, all of them sharing the
+// pool.  the biggest inputs go first, so that the last to finish are small
+// ones, and the pool isn't left mostly idle while one big file trails on.
+// a status line is written for each file as it's finished:  OK, or FAIL and
+// why.  a failed file's output is removed, and the rest carry on.  the fast-
+// mode samples are added to sample, and the number that failed is returned.
+size_t convertManifest( std::vector<FilePair> const& pairs, ThreadPool& pool,
+                        FileOptions const& fileOpts, unsigned nAtOnce,
+                        QualCompressor::Sample& sample )
+{
+    std::vector<std::pair<off_t,size_t>> order; // input size and index into pairs
+    for ( size_t idx = 0; idx != pairs.size(); ++idx )
+    {
+        struct stat sb;
+        order.push_back(std::make_pair(stat(pairs[idx].first.c_str(),&sb) ? 0 : sb.st_size,idx));
+    }
+    std::stable_sort(order.begin(),order.end(),
+        []( std::pair<off_t,size_t> const& p1, std::pair<off_t,size_t> const& p2 )
+        { return p1.first > p2.first; });
+
+    std::atomic<size_t> next(0);
+    std::mutex mutex;
+    size_t nFailed = 0;
+    auto work = [&]
+    { size_t idx;
+      while ( (idx = next++) < order.size() )
+      { FilePair const& files = pairs[order[idx].second];
+        Stats::Clock::time_point start = Stats::Clock::now();
+        QualCompressor::Sample fileSample;
+        std::string error;
+        try
+        { fileSample = convertFile(files.first.c_str(),files.second.c_str(),pool,fileOpts); }
+        catch ( std::exception const& e )
+        { error = e.what();
+          unlink(files.second.c_str());
+          if ( fileOpts.mBAI )
+              unlink((files.second+".bai").c_str());
+          if ( fileOpts.mCSI )
+              unlink((files.second+".csi").c_str()); }
+        std::chrono::duration<double> secs = Stats::Clock::now() - start;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::cout << files.first << '\t' << files.second;
+        if ( !error.empty() )
+        {
+            nFailed += 1;
+            std::cout << "\tFAIL\t" << error << std::endl;
+            continue;
+        }
+        sample += fileSample;
+        std::cout << "\tOK\t" << std::fixed << std::setprecision(2) << secs.count() << "s"
+                  << std::endl; } };
+
+    std::vector<std::thread> threads;
+    while ( threads.size() + 1 < std::min(size_t(nAtOnce),order.size()) )
+        threads.emplace_back(work);
+    work();
+    for ( std::thread& thread : threads )
+        thread.join();
+    return nFailed;
+}
+
+int main( int argc, char** argv )
+{
+    unsigned nThreads = 0;
+    FileOptions fileOpts;
+    char const* statsFile = 0;
+    unsigned statsInterval = 0;
+    char const* manifest = 0;
+    unsigned nAtOnce = 0;
+    static option const LONG_OPTS[] =
+    { {"fast",no_argument,0,'f'}, {"delta",no_argument,0,'d'}, {"rans",no_argument,0,'R'},
+      {"dict",no_argument,0,'D'},
+      {"stats",required_argument,0,'S'},
+      {"stats-interval",required_argument,0,'I'}, {"bai",no_argument,0,'b'},
+      {"csi",no_argument,0,'c'}, {"region",required_argument,0,'r'},
+      {"manifest",required_argument,0,'M'}, {"verify",no_argument,0,'V'},
+      {"copy-blocks",no_argument,0,'C'}, {"aligned-blocks",no_argument,0,'A'},
+      {0,0,0,0} };
+    int opt;
+    while ( (opt = getopt_long(argc,argv,"@:l:s:r:j:",LONG_OPTS,0)) != -1 )
+    {
+        switch ( opt )
+        {
+        case '@':
+        {   char* end;
+            long val = strtol(optarg,&end,10);
+            if ( *end || val < 0 || val > 1024 )
+                usage();
+            nThreads = val;
+            break;  }
+        case 'l':
+            if ( optarg[0] < '0' || optarg[0] > '9' || optarg[1] )
+                usage();
+            fileOpts.mLevel = optarg[0] - '0';
+            break;
+        case 's':
+            fileOpts.mStrategy = getStrategy(optarg);
+            break;
+        case 'f':
+            fileOpts.mCodecs.mFast = true;
+            break;
+        case 'd':
+            fileOpts.mCodecs.mDelta = true;
+            break;
+        case 'R':
+            fileOpts.mCodecs.mRans = true;
+            break;
+        case 'D':
+            fileOpts.mDict = true;
+            break;
+        case 'V':
+            fileOpts.mCodecs.mVerify = true;
+            break;
+        case 'C':
+            fileOpts.mCopyBlocks = true;
+            break;
+        case 'A':
+            fileOpts.mAlignedBlocks = true;
+            break;
+        case 'S':
+            statsFile = optarg;
+            break;
+        case 'I':
+        {   char* end;
+            long val = strtol(optarg,&end,10);
+            if ( *end || val <= 0 )
+                usage();
+            statsInterval = val;
+            break;  }
+        case 'b':
+            fileOpts.mBAI = true;
+            break;
+        case 'c':
+            fileOpts.mCSI = true;
+            break;
+        case 'r':
+            fileOpts.mpRegion = optarg;
+            break;
+        case 'M':
+            manifest = optarg;
+            break;
+        case 'j':
+        {   char* end;
+            long val = strtol(optarg,&end,10);
+            if ( *end || val <= 0 || val > 1024 )
+                usage();
+            nAtOnce = val;
+            break;  }
+        default:
+            usage();
         }
+    }
+    if ( argc - optind != (manifest ? 0 : 2) || (statsInterval && !statsFile) ||
+            (nAtOnce && !manifest) )
+        usage();
+    char const* inFile = manifest ? 0 : argv[optind];
+    char const* outFile = manifest ? 0 : argv[optind+1];
+    if ( inFile && fileOpts.mpRegion && !strcmp(inFile,"-") )
+    {
+        std::cerr << "-r needs an indexed input file, not standard input." << std::endl;
+        exit(1);
+    }
+    if ( outFile && (fileOpts.mBAI || fileOpts.mCSI) && !strcmp(outFile,"-") )
+    {
+        std::cerr << "--bai and --csi need an output file to name the index after,"
+                     " not standard output." << std::endl;
+        exit(1);
+    }
 
-        if ( auxLen < 0 )
-            BAMERR(inFile," has bogus alignment block len for alignment " << alnNo);
-        std::string alnBytes = oss.str();
-        aln.mRemainingBlockSize = alnBytes.size() + sizeof(aln) - sizeof(aln.mRemainingBlockSize);
-        if ( !os.write(reinterpret_cast<char const*>(&aln),sizeof(aln)) )
-            BAMERR(outFile," alignment header in alignment " << alnNo);
-        if ( !os.write(&alnBytes[0],alnBytes.size()) )
-            BAMERR(outFile," alignment data in alignment " << alnNo);
+    // declared first so that it's destroyed last, when the output is complete
+    std::unique_ptr<StatsReporter> pStats;
+    if ( statsFile )
+        pStats.reset(new StatsReporter(statsFile,statsInterval));
+    ThreadPool pool(nThreads);
+    QualCompressor::Sample sample;
+    size_t nFailed = 0;
+    if ( manifest )
+        nFailed = convertManifest(readManifest(manifest),pool,fileOpts,
+                                    nAtOnce ? nAtOnce : 1 + nThreads/4,sample);
+    else
+    {
+        try
+        {
+            sample = convertFile(inFile,outFile,pool,fileOpts);
+        }
+        catch ( std::exception const& e )
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if ( sample.mNQualVecs )
+        std::cerr << "Fast mode: ZQ tags were " << std::fixed << std::setprecision(2)
+                  << 100.*sample.mFastSize/sample.mOptimalSize - 100.
+                  << "% bigger than optimal for a sample of " << sample.mNQualVecs
+                  << " reads." << std::endl;
+    if ( nFailed )
+    {
+        std::cerr << nFailed << " of the manifest's files failed." << std::endl;
+        return 1;
     }
 }
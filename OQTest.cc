@@ -0,0 +1,1398 @@
+/*
+ * OQTest.cc
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+// checks that QualCompressor partitions quals optimally, by comparing plan and
+// encode against a brute-force dynamic program.  the quals are synthetic, plus
+// the QUAL fields of any BAMs named on the command line.  then it checks the
+// delta, dictionary, and rANS codecs, and that what they can't unpack is
+// rejected.  then it checks the indexes
+// BAMIndexer writes, and OQCompress's conversions of regions, against
+// brute-force scans of BAMs built here, the checksums that --verify reports,
+// the blocks that --copy-blocks copies, and where --aligned-blocks ends them.
+// "make test" runs it, in the directory where it builds OQCompress.
+
+#include "BAMIndex.h"
+#include "BGZF.h"
+#include "QualCompressor.h"
+#include "QualDict.h"
+#include "RansCodec.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+namespace
+{
+
+unsigned const QUAL_OFFSET = 33;
+
+// the obvious dynamic program:  the best partition of the first pos+1 quals
+// ends in the block from some start through pos, and we try every start.  ties
+// go to the shortest last block, as they do in QualCompressor.  returns the
+// packed string.
+std::vector<char> referencePack( std::vector<uint8_t> const& quals )
+{
+    struct Block { unsigned mNQs; unsigned mBits; unsigned mMinQ; };
+    auto blockSize = []( unsigned nQs, unsigned bits ) { return (nQs*bits+17+7)>>3; };
+    size_t nQuals = quals.size();
+    std::vector<unsigned> costs(nQuals+1,0);
+    std::vector<Block> lastBlocks(nQuals);
+    for ( size_t pos = 0; pos != nQuals; ++pos )
+    {
+        unsigned minQ = quals[pos];
+        unsigned maxQ = minQ;
+        unsigned best = ~0u;
+        for ( size_t nQs = 1; nQs <= std::min<size_t>(pos+1,255); ++nQs )
+        {
+            size_t start = pos + 1 - nQs;
+            minQ = std::min<unsigned>(minQ,quals[start]);
+            maxQ = std::max<unsigned>(maxQ,quals[start]);
+            unsigned bits = 0;
+            while ( (1u << bits) <= maxQ - minQ )
+                bits += 1;
+            unsigned cost = costs[start] + blockSize(nQs,bits);
+            if ( cost < best )
+            {
+                best = cost;
+                lastBlocks[pos] = Block{unsigned(nQs),bits,minQ};
+            }
+        }
+        costs[pos+1] = best;
+    }
+
+    std::vector<Block> blocks;
+    for ( size_t pos = nQuals; pos; pos -= blocks.back().mNQs )
+        blocks.push_back(lastBlocks[pos-1]);
+    std::reverse(blocks.begin(),blocks.end());
+
+    // each block is a count, 3 bits of width, 6 bits of minimum qual, and then
+    // the quals less the minimum, all least significant bit first
+    std::vector<char> packed;
+    size_t idx = 0;
+    for ( Block const& block : blocks )
+    {
+        packed.push_back(block.mNQs);
+        std::vector<uint8_t> bytes(blockSize(block.mNQs,block.mBits)-1,0);
+        unsigned bitOff = 0;
+        auto put = [&]( unsigned val, unsigned nBits )
+        { for ( unsigned bit = 0; bit != nBits; ++bit, ++bitOff )
+              if ( val & (1u << bit) )
+                  bytes[bitOff>>3] |= 1u << (bitOff&7); };
+        put(block.mBits,3);
+        put(block.mMinQ,6);
+        for ( unsigned qIdx = 0; qIdx != block.mNQs; ++qIdx )
+            put(quals[idx++]-block.mMinQ,block.mBits);
+        packed.insert(packed.end(),bytes.begin(),bytes.end());
+    }
+    packed.push_back(0);
+    return packed;
+}
+
+class Checker
+{
+public:
+    Checker() : mNVecs(0), mNQuals(0), mNFailed(0) {}
+
+    // quals are raw scores, with no offset
+    void check( std::vector<uint8_t> const& quals, std::string const& source )
+    {
+        std::vector<char> expected = referencePack(quals);
+        std::string printable;
+        for ( uint8_t qual : quals )
+            printable.push_back(qual+QUAL_OFFSET);
+        char const* pQuals = printable.data();
+        uint32_t len = printable.size();
+
+        size_t planned = mQC.plan(pQuals,len,QUAL_OFFSET);
+        std::vector<char> packed;
+        std::vector<size_t> offsets;
+        mQC.encode(&pQuals,&len,1,QUAL_OFFSET,packed,offsets);
+        char const* pPacked = packed.data();
+        uint32_t packedLen = packed.size();
+        std::vector<char> unpacked;
+        mQC.decode(&pPacked,&packedLen,&len,1,QUAL_OFFSET,unpacked,offsets);
+
+        mNVecs += 1;
+        mNQuals += quals.size();
+        char const* what = 0;
+        if ( planned != expected.size() )
+            what = "plan's size isn't optimal";
+        else if ( packed != expected )
+            what = "encode's blocks aren't the reference partition";
+        else if ( std::string(unpacked.begin(),unpacked.end()) != printable )
+            what = "decode doesn't give back the quals";
+        if ( !what )
+            return; // EARLY RETURN!
+        if ( ++mNFailed <= 10 )
+        {
+            std::cout << source << ": " << what << " (planned " << planned << ", encoded "
+                      << packed.size() << ", optimal " << expected.size() << ") for quals";
+            for ( uint8_t qual : quals )
+                std::cout << ' ' << unsigned(qual);
+            std::cout << std::endl;
+        }
+    }
+
+    void report( std::string const& source )
+    {
+        std::cout << source << ": " << mNVecs << " qual vectors, " << mNQuals << " quals, "
+                  << mNFailed << " failed" << std::endl;
+        mNVecsTotal += mNVecs;
+        mNFailedTotal += mNFailed;
+        mNVecs = mNQuals = mNFailed = 0;
+    }
+
+    static size_t mNVecsTotal;
+    static size_t mNFailedTotal;
+
+private:
+    QualCompressor mQC;
+    size_t mNVecs;
+    size_t mNQuals;
+    size_t mNFailed;
+};
+
+size_t Checker::mNVecsTotal;
+size_t Checker::mNFailedTotal;
+
+// vectors that once went wrong, and edge cases
+void checkFixed( Checker& checker )
+{
+    // the partitioner used to assemble its blocks incrementally, and that list
+    // could be costlier than the partition its cost table had found:  it
+    // packed the first of these in 7 bytes instead of 6
+    checker.check({37,31,4,4},"regression");
+    checker.check({19,19,19,1,1,1,1,1,19,19},"regression");
+    checker.check({},"edge");
+    checker.check({0},"edge");
+    checker.check({63},"edge");
+    for ( size_t len : { 254, 255, 256, 510, 511, 1000 } )
+    {
+        checker.check(std::vector<uint8_t>(len,30),"edge");
+        std::vector<uint8_t> quals;
+        for ( size_t idx = 0; idx != len; ++idx )
+            quals.push_back(idx&1 ? 63 : 0);
+        checker.check(quals,"edge");
+    }
+    checker.report("fixed cases");
+}
+
+unsigned uniform( std::mt19937& rng, unsigned lo, unsigned hi )
+{ return std::uniform_int_distribution<unsigned>(lo,hi)(rng); }
+
+// 4-bin quals, mostly the top one
+void binned( std::mt19937& rng, std::vector<uint8_t>& quals )
+{
+    unsigned len = uniform(rng,1,300);
+    for ( unsigned idx = 0; idx != len; ++idx )
+    {
+        unsigned roll = uniform(rng,0,99);
+        quals.push_back(roll < 85 ? 37 : roll < 94 ? 23 : roll < 99 ? 12 : 2);
+    }
+}
+
+// full-resolution quals that droop toward the end of a 150bp read, with the
+// occasional dip, and a tail of 2s on some reads
+void noisy( std::mt19937& rng, std::vector<uint8_t>& quals )
+{
+    unsigned const LEN = 150;
+    unsigned tail = uniform(rng,0,9) ? LEN : uniform(rng,LEN/2,LEN);
+    int base = uniform(rng,32,38);
+    for ( unsigned idx = 0; idx != LEN; ++idx )
+    {
+        int val = base - int(idx*8/LEN) + int(uniform(rng,0,8)) - 4;
+        if ( !uniform(rng,0,40) ) val -= uniform(rng,5,20);
+        if ( idx >= tail ) val = 2;
+        quals.push_back(std::max(2,std::min(41,val)));
+    }
+}
+
+// long runs of the same qual, over a length that spans several blocks
+void runHeavy( std::mt19937& rng, std::vector<uint8_t>& quals )
+{
+    unsigned len = uniform(rng,200,2000);
+    while ( quals.size() < len )
+    {
+        unsigned val = uniform(rng,0,63);
+        unsigned runLen = std::geometric_distribution<unsigned>(1./20)(rng) + 1;
+        quals.insert(quals.end(),std::min<size_t>(runLen,len-quals.size()),val);
+    }
+}
+
+// short vectors of a few distinct values, anywhere in the range
+void fewValues( std::mt19937& rng, std::vector<uint8_t>& quals )
+{
+    unsigned len = uniform(rng,1,20);
+    std::vector<uint8_t> vals(uniform(rng,1,5));
+    for ( uint8_t& val : vals )
+        val = uniform(rng,0,63);
+    for ( unsigned idx = 0; idx != len; ++idx )
+        quals.push_back(vals[uniform(rng,0,vals.size()-1)]);
+}
+
+void checkSynthetic( Checker& checker )
+{
+    std::mt19937 rng(1);
+    std::vector<uint8_t> quals;
+    struct Profile
+    { char const* mName; void (*mGenerate)( std::mt19937&, std::vector<uint8_t>& );
+      unsigned mNVecs; };
+    Profile const PROFILES[] =
+    { {"binned",binned,20000}, {"noisy",noisy,20000}, {"run-heavy",runHeavy,2000},
+      {"few values",fewValues,100000} };
+    for ( Profile const& profile : PROFILES )
+    {
+        for ( unsigned idx = 0; idx != profile.mNVecs; ++idx )
+        {
+            quals.clear();
+            profile.mGenerate(rng,quals);
+            checker.check(quals,profile.mName);
+        }
+        checker.report(profile.mName);
+    }
+}
+
+void badBAM( char const* bamFile, char const* why )
+{
+    std::cout << bamFile << ": " << why << std::endl;
+    exit(1);
+}
+
+template <class T>
+T read( std::istream& is, char const* bamFile )
+{
+    T val;
+    if ( !is.read(reinterpret_cast<char*>(&val),sizeof(val)) )
+        badBAM(bamFile,"truncated header");
+    return val;
+}
+
+// checks the QUAL field of each of the BAM's records
+void checkBAM( Checker& checker, char const* bamFile )
+{
+    BAMistream is(bamFile);
+    if ( read<uint32_t>(is,bamFile) != 0x014d4142 ) // "BAM\1"
+        badBAM(bamFile,"not a BAM");
+    is.ignore(read<uint32_t>(is,bamFile));
+    uint32_t nRefs = read<uint32_t>(is,bamFile);
+    while ( nRefs-- )
+        is.ignore(read<uint32_t>(is,bamFile)+sizeof(uint32_t));
+
+    std::vector<char> rec;
+    std::vector<uint8_t> quals;
+    uint32_t recLen;
+    while ( is.read(reinterpret_cast<char*>(&recLen),sizeof(recLen)) )
+    {
+        rec.resize(recLen);
+        if ( recLen < 32 || !is.read(rec.data(),recLen) )
+            badBAM(bamFile,"truncated alignment");
+        uint8_t nameLen = rec[8];
+        uint16_t nCigarOps;
+        memcpy(&nCigarOps,&rec[12],sizeof(nCigarOps));
+        uint32_t seqLen;
+        memcpy(&seqLen,&rec[16],sizeof(seqLen));
+        size_t qualsOff = 32 + nameLen + 4*nCigarOps + (seqLen+1)/2;
+        if ( qualsOff + seqLen > recLen )
+            badBAM(bamFile,"alignment too short for its quals");
+        uint8_t const* pQuals = reinterpret_cast<uint8_t const*>(&rec[qualsOff]);
+        if ( seqLen && *pQuals == 0xff ) // no quals
+            continue;
+        quals.assign(pQuals,pQuals+seqLen);
+        checker.check(quals,bamFile);
+    }
+    if ( !is.eof() )
+        badBAM(bamFile,"can't read it");
+    checker.report(bamFile);
+}
+
+// failures of the checks that aren't of qual vectors
+size_t gNFailed;
+std::string gTmpDir;
+
+void fail( char const* section, std::string const& what )
+{
+    if ( ++gNFailed <= 20 )
+        std::cout << section << ": " << what << std::endl;
+}
+
+// the name of a scratch file
+std::string tmpFile( char const* name )
+{ return gTmpDir + '/' + name; }
+
+struct TestRef
+{ char const* mName; uint32_t mLen; };
+
+// a BAM alignment record, its block size included.  the read has quals.size()
+// bases, all A, and the quals are printable.  tags are in their BAM form.
+std::string makeAln( int32_t refID, int32_t pos, uint16_t flags,
+                        std::vector<uint32_t> const& cigar, std::string const& name,
+                        std::string const& quals, std::string const& tags = std::string() )
+{
+    BAMAlignHead aln;
+    aln.mRefID = refID;
+    aln.mPos = pos;
+    aln.mNameLen = name.size() + 1;
+    aln.mMapQ = 60;
+    aln.mBin = 0; // nothing here reads it
+    aln.mCigarLen = cigar.size();
+    aln.mFlags = flags;
+    aln.mSeqLen = quals.size();
+    aln.mMateRefID = -1;
+    aln.mMatePos = -1;
+    aln.mTLen = 0;
+    std::string rec(reinterpret_cast<char const*>(&aln),sizeof(aln));
+    rec.append(name.c_str(),name.size()+1);
+    rec.append(reinterpret_cast<char const*>(cigar.data()),4*cigar.size());
+    rec.append((quals.size()+1)/2,'\x11');
+    for ( char qual : quals )
+        rec.push_back(qual-QUAL_OFFSET);
+    rec.append(tags);
+    uint32_t blockSize = rec.size() - sizeof(blockSize);
+    memcpy(&rec[0],&blockSize,sizeof(blockSize));
+    return rec;
+}
+
+// a cigar op
+uint32_t op( uint32_t len, char type )
+{ return len << 4 | (strchr("MIDNSHP=X",type) - "MIDNSHP=X"); }
+
+BAMAlignHead head( std::string const& rec )
+{ BAMAlignHead aln; memcpy(&aln,rec.data(),sizeof(aln)); return aln; }
+
+int64_t refEnd( std::string const& rec )
+{ return getRefEnd(head(rec),rec.data()+sizeof(uint32_t),rec.size()-sizeof(uint32_t)); }
+
+// does the alignment overlap [beg,end) of refID?
+bool overlaps( std::string const& rec, int32_t refID, int64_t beg, int64_t end )
+{ return head(rec).mRefID == refID && head(rec).mPos < end && refEnd(rec) > beg; }
+
+// a BAM's header
+std::string bamHeader( std::vector<TestRef> const& refs, std::string const& text )
+{
+    std::string hdr("BAM\1");
+    uint32_t val = text.size();
+    hdr.append(reinterpret_cast<char const*>(&val),sizeof(val));
+    hdr.append(text);
+    val = refs.size();
+    hdr.append(reinterpret_cast<char const*>(&val),sizeof(val));
+    for ( TestRef const& ref : refs )
+    {
+        val = strlen(ref.mName) + 1;
+        hdr.append(reinterpret_cast<char const*>(&val),sizeof(val));
+        hdr.append(ref.mName,val);
+        hdr.append(reinterpret_cast<char const*>(&ref.mLen),sizeof(ref.mLen));
+    }
+    return hdr;
+}
+
+// writes a BAM of the alignments, and a BAI and a CSI for it, if asked.
+// returns false if a BAI was asked for, but a reference is too long for one.
+bool writeBAM( std::string const& file, std::vector<TestRef> const& refs,
+                std::vector<std::string> const& alns, bool bai = false, bool csi = false,
+                std::string const& text = "@HD\tVN:1.6\tSO:coordinate\n" )
+{
+    std::unique_ptr<BAMIndexer> pIndexer;
+    std::vector<uint32_t> refLens;
+    for ( TestRef const& ref : refs )
+        refLens.push_back(ref.mLen);
+    if ( bai || csi )
+        pIndexer.reset(new BAMIndexer(refLens));
+
+    BAMostream os(file.c_str());
+    os.mSB.setTrackOffsets(bai || csi);
+    std::string hdr = bamHeader(refs,text);
+    os.write(hdr.data(),hdr.size());
+    for ( std::string const& rec : alns )
+    {
+        uint64_t beg = os.tellp();
+        os.write(rec.data(),rec.size());
+        if ( pIndexer )
+        {
+            pIndexer->add(rec.data()+sizeof(uint32_t),rec.size()-sizeof(uint32_t),
+                            beg,beg+rec.size());
+            pIndexer->resolve(os.mSB);
+        }
+    }
+    os.close();
+
+    if ( !pIndexer )
+        return true; // EARLY RETURN!
+    if ( pIndexer->getProblem() )
+        badBAM(file.c_str(),pIndexer->getProblem());
+    if ( csi )
+        pIndexer->writeCSI((file+".csi").c_str(),os.mSB);
+    if ( bai && !pIndexer->canWriteBAI() )
+        return false; // EARLY RETURN!
+    if ( bai )
+        pIndexer->writeBAI((file+".bai").c_str(),os.mSB);
+    return true;
+}
+
+// reads one alignment record, block size and all.  false at end of file.
+bool readAln( std::istream& is, std::string& rec )
+{
+    uint32_t blockSize;
+    if ( !is.read(reinterpret_cast<char*>(&blockSize),sizeof(blockSize)) )
+        return false; // EARLY RETURN!
+    rec.assign(reinterpret_cast<char const*>(&blockSize),sizeof(blockSize));
+    rec.resize(sizeof(blockSize)+blockSize);
+    if ( !is.read(&rec[sizeof(blockSize)],blockSize) )
+        badBAM("test BAM","truncated alignment");
+    return true;
+}
+
+// the alignments of a BAM, and its header's text
+std::vector<std::string> readBAM( std::string const& file, std::string* pText = 0 )
+{
+    BAMistream is(file.c_str());
+    if ( read<uint32_t>(is,file.c_str()) != 0x014d4142 )
+        badBAM(file.c_str(),"not a BAM");
+    std::string text(read<uint32_t>(is,file.c_str()),'\0');
+    if ( !is.read(&text[0],text.size()) )
+        badBAM(file.c_str(),"truncated header");
+    if ( pText )
+        *pText = text;
+    uint32_t nRefs = read<uint32_t>(is,file.c_str());
+    while ( nRefs-- )
+        is.ignore(read<uint32_t>(is,file.c_str())+sizeof(uint32_t));
+    std::vector<std::string> alns;
+    std::string rec;
+    while ( readAln(is,rec) )
+        alns.push_back(rec);
+    return alns;
+}
+
+// sorted alignments for testing indexes and regions:  reads that span large
+// introns, placed reads that are unmapped, a few with no cigar, and piles of
+// them at the start and at a linear index window boundary.  the second
+// reference has none, and there are some unplaced ones at the end.
+std::vector<std::string> sortedAlns( std::mt19937& rng, std::vector<TestRef> const& refs )
+{
+    std::vector<std::string> alns;
+    for ( int32_t refID = 0; refID != int32_t(refs.size()); ++refID )
+    {
+        if ( refID == 1 )
+            continue;
+        uint32_t refLen = refs[refID].mLen;
+        std::vector<int32_t> poses;
+        for ( unsigned idx = 0; idx != 3000; ++idx )
+            poses.push_back(uniform(rng,0,refLen-1));
+        poses.insert(poses.end(),40,0);
+        poses.insert(poses.end(),40,(1 << BAMIndexer::MIN_SHIFT) - 50);
+        std::sort(poses.begin(),poses.end());
+        for ( int32_t pos : poses )
+        {
+            std::vector<uint32_t> cigar;
+            uint16_t flags = 0;
+            unsigned roll = uniform(rng,0,99);
+            if ( roll < 3 )
+                flags = 4;
+            else if ( roll < 5 )
+                ; // mapped, but no cigar
+            else if ( roll < 10 )
+                cigar = { op(50,'M'), op(uniform(rng,1000,300000),'N'), op(50,'M') };
+            else
+                cigar = { op(5,'S'), op(95,'M') };
+            std::string rec = makeAln(refID,pos,flags,cigar,"r"+std::to_string(alns.size()),
+                                        std::string(100,'I'));
+            if ( refEnd(rec) <= refLen )
+                alns.push_back(rec);
+        }
+    }
+    for ( unsigned idx = 0; idx != 20; ++idx )
+        alns.push_back(makeAln(-1,-1,4,{},"u"+std::to_string(idx),std::string(100,'#')));
+    return alns;
+}
+
+// the alignments that overlap [beg,end) of refID, in file order
+std::vector<std::string> overlapping( std::vector<std::string> const& alns, int32_t refID,
+                                        int64_t beg, int64_t end )
+{
+    std::vector<std::string> result;
+    for ( std::string const& rec : alns )
+        if ( overlaps(rec,refID,beg,end) )
+            result.push_back(rec);
+    return result;
+}
+
+// some regions of a reference:  all of it, its ends, just past its end, across
+// the first window boundary, and random ones, short and long
+std::vector<std::pair<int64_t,int64_t>> testRegions( std::mt19937& rng, uint32_t refLen )
+{
+    int64_t const WIN = 1 << BAMIndexer::MIN_SHIFT;
+    std::vector<std::pair<int64_t,int64_t>> regions =
+    { {0,refLen}, {0,1}, {refLen-1,refLen}, {refLen,refLen+1000}, {WIN-1,WIN+1} };
+    for ( unsigned idx = 0; idx != 40; ++idx )
+    {
+        int64_t beg = uniform(rng,0,refLen-1);
+        regions.push_back(std::make_pair(beg,beg+uniform(rng,1,idx < 20 ? 2000 : 500000)));
+    }
+    return regions;
+}
+
+// the alignments in an index's chunks that overlap [beg,end) of refID
+std::vector<std::string> readRegion( std::string const& bam, BAMIndex const& index,
+                                        int32_t refID, int64_t beg, int64_t end )
+{
+    std::vector<std::string> alns;
+    BAMistream is(bam.c_str());
+    std::string rec;
+    for ( BAMIndex::Chunk const& chunk : index.getChunks(refID,beg,end) )
+    {
+        is.clear();
+        if ( !is.mSB.virtualSeek(chunk.mBeg) )
+            badBAM(bam.c_str(),"can't seek to an index chunk");
+        while ( is.mSB.virtualTell() < chunk.mEnd && readAln(is,rec) )
+            if ( overlaps(rec,refID,beg,end) )
+                alns.push_back(rec);
+    }
+    return alns;
+}
+
+// checks that an index's chunks for each region hold just the alignments that
+// overlap it, once each, and that its counts of placed reads are right
+void checkIndexFile( std::mt19937& rng, std::string const& bam, std::string const& indexFile,
+                        std::vector<TestRef> const& refs, std::vector<std::string> const& alns,
+                        size_t& nRegions )
+{
+    BAMIndex index(indexFile.c_str());
+    for ( int32_t refID = 0; refID != int32_t(refs.size()); ++refID )
+    {
+        uint64_t nMapped = 0, nUnmapped = 0;
+        for ( std::string const& rec : alns )
+            if ( head(rec).mRefID == refID )
+                (head(rec).mFlags & 4 ? nUnmapped : nMapped) += 1;
+        uint64_t nIdxMapped, nIdxUnmapped;
+        bool hasCounts = index.getCounts(refID,nIdxMapped,nIdxUnmapped);
+        if ( hasCounts != (nMapped || nUnmapped) ||
+                (hasCounts && (nIdxMapped != nMapped || nIdxUnmapped != nUnmapped)) )
+            fail("index",indexFile+":  wrong counts for "+refs[refID].mName);
+
+        for ( auto const& region : testRegions(rng,refs[refID].mLen) )
+        {
+            nRegions += 1;
+            std::vector<std::string> expected =
+                    overlapping(alns,refID,region.first,region.second);
+            if ( readRegion(bam,index,refID,region.first,region.second) != expected )
+                fail("index",indexFile+":  wrong alignments for "+refs[refID].mName+':'+
+                        std::to_string(region.first)+'-'+std::to_string(region.second));
+        }
+    }
+}
+
+// indexes BAMs as they're written, and checks their BAIs and CSIs.  a reference
+// too long for a BAI makes the CSI deeper.
+void checkIndexes()
+{
+    std::mt19937 rng(2);
+    size_t nFailed = gNFailed;
+    size_t nRegions = 0;
+    std::vector<TestRef> refs = { {"chr1",2000000}, {"empty",100000}, {"chr3",3000000} };
+    std::vector<std::string> alns = sortedAlns(rng,refs);
+    std::string bam = tmpFile("sorted.bam");
+    if ( !writeBAM(bam,refs,alns,true,true) )
+        fail("index","no BAI for short references");
+    checkIndexFile(rng,bam,bam+".bai",refs,alns,nRegions);
+    checkIndexFile(rng,bam,bam+".csi",refs,alns,nRegions);
+
+    refs.push_back(TestRef{"huge",1500000000});
+    alns = sortedAlns(rng,refs);
+    bam = tmpFile("huge.bam");
+    if ( writeBAM(bam,refs,alns,true,true) )
+        fail("index","a BAI for a reference too long for one");
+    checkIndexFile(rng,bam,bam+".csi",refs,alns,nRegions);
+    std::cout << "indexes: " << nRegions << " regions, " << gNFailed-nFailed << " failed"
+              << std::endl;
+}
+
+// runs OQCompress, which make builds alongside this, with the given arguments.
+// returns its exit status, and what it wrote to standard error, if asked.
+int runOQCompress( std::string const& args, std::string* pErr = 0 )
+{
+    std::string errFile = pErr ? tmpFile("stderr") : "/dev/null";
+    int status = system(("./OQCompress " + args + " 2>" + errFile).c_str());
+    if ( pErr )
+    {
+        std::ifstream in(errFile);
+        pErr->assign(std::istreambuf_iterator<char>(in),std::istreambuf_iterator<char>());
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// converts regions of an indexed BAM with -r, and checks that just the
+// alignments overlapping each region come out
+void checkRegions()
+{
+    std::mt19937 rng(3);
+    size_t nFailed = gNFailed;
+    std::vector<TestRef> refs = { {"chr1",2000000}, {"empty",100000}, {"chr3",3000000} };
+    std::vector<std::string> alns = sortedAlns(rng,refs);
+    std::string bam = tmpFile("regions.bam");
+    std::string out = tmpFile("region.bam");
+    writeBAM(bam,refs,alns,true);
+
+    // the region, and what it means:  a zero-based, half-open interval
+    struct Region
+    { char const* mRegion; int32_t mRefID; int64_t mBeg; int64_t mEnd; };
+    Region const REGIONS[] =
+    { {"chr1",0,0,INT64_MAX}, {"chr3:1000000",2,999999,INT64_MAX},
+      {"chr3:1-1",2,0,1}, {"chr1:16000-16500",0,15999,16500}, {"empty",1,0,INT64_MAX},
+      {"empty:1-1000",1,0,1000}, {"chr3:5000-2000000",2,4999,2000000} };
+    for ( Region const& region : REGIONS )
+    {
+        for ( char const* threads : { "", "-@ 2 " } )
+        {
+            std::string args = std::string(threads) + "-r " + region.mRegion + ' ' + bam + ' ' + out;
+            if ( runOQCompress(args) )
+                fail("regions","OQCompress "+args+" failed");
+            else if ( readBAM(out) != overlapping(alns,region.mRefID,region.mBeg,region.mEnd) )
+                fail("regions","OQCompress "+args+" wrote the wrong alignments");
+        }
+    }
+
+    // that last region had better need more than one chunk to be a test of
+    // moving between them
+    BAMIndex index((bam+".bai").c_str());
+    if ( index.getChunks(2,4999,2000000).size() < 2 )
+        fail("regions","chr3:5000-2000000 doesn't span index chunks");
+
+    if ( !runOQCompress("-r nope:1-100 "+bam+' '+out) )
+        fail("regions","a region on an unknown reference didn't fail");
+    std::cout << "regions: " << sizeof(REGIONS)/sizeof(REGIONS[0])+1 << " regions, "
+              << gNFailed-nFailed << " failed" << std::endl;
+}
+
+// decodes a coded string with RansCodec.  a corrupt one may come out as some
+// other string of nQuals quals, but it mustn't come out any other length.
+bool ransDecode( RansCodec& codec, unsigned order, std::vector<char> const& coded,
+                    size_t len, unsigned nQuals, std::vector<char>& out )
+{
+    out.clear();
+    uint8_t const* pCoded = reinterpret_cast<uint8_t const*>(coded.data());
+    bool ok = order ? codec.decode1(pCoded,len,nQuals,QUAL_OFFSET,out) :
+                        codec.decode0(pCoded,len,nQuals,QUAL_OFFSET,out);
+    if ( ok && out.size() != nQuals )
+        fail("rANS","a decode that succeeded has the wrong number of quals");
+    return ok;
+}
+
+// does QualCompressor reject the packed string, when it ought to have nQuals?
+bool rejects( QualCompressor& qc, std::vector<char> const& packed, uint32_t nQuals,
+                QualCompressor::Recal const* pRecal = 0 )
+{
+    char const* pPacked = packed.data();
+    uint32_t len = packed.size();
+    std::vector<char> out;
+    std::vector<size_t> offsets;
+    try
+    {
+        qc.decode(&pPacked,&len,&nQuals,1,QUAL_OFFSET,out,offsets,pRecal);
+    }
+    catch ( std::runtime_error const& )
+    {
+        return true;
+    }
+    return false;
+}
+
+// packs and unpacks one string of printable quals.  returns the packed string,
+// and fails if it doesn't unpack to the quals.
+std::vector<char> roundTrip( QualCompressor& qc, std::string const& quals,
+                                QualCompressor::Recal const* pRecal, char const* section )
+{
+    char const* pQuals = quals.data();
+    uint32_t len = quals.size();
+    std::vector<char> packed;
+    std::vector<size_t> offsets;
+    qc.encode(&pQuals,&len,1,QUAL_OFFSET,packed,offsets,pRecal);
+    char const* pPacked = packed.data();
+    uint32_t packedLen = packed.size();
+    std::vector<char> out;
+    qc.decode(&pPacked,&packedLen,&len,1,QUAL_OFFSET,out,offsets,pRecal);
+    if ( std::string(out.begin(),out.end()) != quals )
+        fail(section,"a string of "+std::to_string(len)+" quals doesn't unpack to itself");
+    return packed;
+}
+
+// was the packed string packed with codec?
+bool packedAs( std::vector<char> const& packed, QualCompressor::Codec codec )
+{ return packed.size() >= 2 && !packed[0] && packed[1] == codec; }
+
+// packing against QUAL:  reads whose QUAL is close to OQ are packed that way,
+// and those with a difference too big for a residual aren't.  unpacking one
+// without QUAL, or with one of another length, is rejected.
+void checkDelta()
+{
+    std::mt19937 rng(5);
+    size_t nFailed = gNFailed;
+    size_t nDelta = 0;
+    unsigned const N_READS = 2000;
+    for ( bool fast : { false, true } )
+    {
+        QualCompressor qc(fast,true);
+        for ( unsigned idx = 0; idx != N_READS; ++idx )
+        {
+            std::vector<uint8_t> quals;
+            noisy(rng,quals);
+            std::string printable;
+            std::string recals;
+            for ( uint8_t qual : quals )
+            {
+                printable.push_back(qual+QUAL_OFFSET);
+                recals.push_back(std::max(0,int(qual)+int(uniform(rng,0,2))-1));
+            }
+
+            // a quarter of them have a difference that won't fit.  31 is the
+            // one qual that's within range of every recal.
+            bool tooFar = !(idx % 4);
+            if ( tooFar )
+            {
+                unsigned pos;
+                do pos = uniform(rng,0,quals.size()-1);
+                while ( quals[pos] == 31 );
+                recals[pos] = quals[pos] < QualCompressor::DELTA_BIAS ? 63 : 0;
+            }
+            QualCompressor::Recal recal(recals.data(),recals.size());
+            std::vector<char> packed = roundTrip(qc,printable,&recal,"delta");
+            if ( !packedAs(packed,QualCompressor::DELTA_QUAL) )
+                continue;
+            nDelta += 1;
+            if ( tooFar )
+                fail("delta","a residual out of range was packed");
+            QualCompressor::Recal none;
+            QualCompressor::Recal shorter(recals.data(),recals.size()-1);
+            uint32_t len = printable.size();
+            if ( !rejects(qc,packed,len) || !rejects(qc,packed,len,&none) ||
+                    !rejects(qc,packed,len,&shorter) )
+                fail("delta","a string packed against QUAL unpacks without the right one");
+        }
+    }
+    // most of those that can be should have been packed against QUAL
+    if ( nDelta < N_READS )
+        fail("delta","only "+std::to_string(nDelta)+" reads were packed against QUAL");
+    std::cout << "delta: " << 2*N_READS << " reads, " << nDelta << " packed against QUAL, "
+              << gNFailed-nFailed << " failed" << std::endl;
+}
+
+// a dictionary's quals, in rank order
+std::vector<unsigned> dictQuals( QualDict const& dict )
+{
+    std::vector<unsigned> quals;
+    for ( unsigned rank = 0; rank != dict.size(); ++rank )
+        quals.push_back(dict.qual(rank));
+    return quals;
+}
+
+// the header line and its parsing, and taking it out of and putting it into
+// the header text, which mustn't otherwise change
+void checkDictHeader()
+{
+    uint64_t counts[QualDict::MAX_Q+1] = {};
+    counts[2] = counts[12] = counts[23] = counts[37] = 1;
+    QualDict dict;
+    dict.build(counts);
+    std::string line = dict.headerLine();
+    QualDict parsed;
+    if ( !parsed.parseHeaderLine(line.data(),line.data()+line.size()-1) ||
+            dictQuals(parsed) != dictQuals(dict) )
+        fail("dict","a header line doesn't parse to its dictionary");
+    std::string other("@CO\tsome other comment");
+    if ( parsed.parseHeaderLine(other.data(),other.data()+other.size()) )
+        fail("dict","a comment was taken for a dictionary");
+
+    std::string const TAG("@CO\tOQCompress qual dictionary:");
+    for ( char const* garbled : { "", "2,", ",2", "2,,12", "12,2", "2,2", "2,64", "x", "2;12",
+                                  "2,12 ", "-1" } )
+    {
+        std::string bad = TAG + garbled;
+        try
+        {
+            parsed.parseHeaderLine(bad.data(),bad.data()+bad.size());
+            fail("dict","the garbled line \""+bad+"\" was read");
+        }
+        catch ( std::runtime_error const& )
+        {}
+    }
+
+    // with and without a trailing newline, with a dictionary already in the
+    // middle, and padded with NULs
+    std::string const HD("@HD\tVN:1.6\tSO:coordinate\n");
+    std::string const SQ("@SQ\tSN:chr1\tLN:1000\n");
+    std::string padded = HD + SQ;
+    padded.append(3,'\0');
+    for ( std::string const& text : { std::string(), HD + SQ, HD + line + SQ, padded } )
+    {
+        std::string withDict(text);
+        dict.insertInto(withDict);
+        std::string without(withDict);
+        if ( !parsed.extractFrom(without) || dictQuals(parsed) != dictQuals(dict) )
+            fail("dict","a dictionary added to a header can't be taken out again");
+        else if ( text.find(line) != std::string::npos )
+        {
+            // the first dictionary's the one that's taken out
+            if ( without != HD + SQ + line )
+                fail("dict","taking out a dictionary changed the rest of the header");
+        }
+        else if ( without != text )
+            fail("dict","taking out a dictionary changed the rest of the header");
+        if ( strlen(withDict.c_str()) != withDict.size() - (text.size() - strlen(text.c_str())) )
+            fail("dict","a dictionary was added after the header's padding");
+    }
+    std::string noNewline("@HD\tVN:1.6");
+    std::string withDict(noNewline);
+    dict.insertInto(withDict);
+    if ( withDict != noNewline + '\n' + line )
+        fail("dict","a dictionary wasn't put on a line of its own");
+    QualDict none;
+    std::string text(HD + SQ);
+    if ( none.extractFrom(text) || text != HD + SQ || !none.empty() )
+        fail("dict","a dictionary was found in a header without one");
+}
+
+// packing as ranks in a dictionary:  binned reads are packed that way, and
+// those with a qual that isn't in the dictionary aren't.  unpacking one without
+// a dictionary, or with one too small for its ranks, is rejected.
+void checkDict()
+{
+    std::mt19937 rng(6);
+    size_t nFailed = gNFailed;
+    checkDictHeader();
+
+    uint64_t counts[QualDict::MAX_Q+1] = {};
+    counts[2] = counts[12] = counts[23] = counts[37] = 1;
+    QualDict dict;
+    dict.build(counts);
+    uint64_t fewerCounts[QualDict::MAX_Q+1] = {};
+    fewerCounts[2] = fewerCounts[12] = 1;
+    QualDict fewer;
+    fewer.build(fewerCounts);
+
+    size_t nDict = 0;
+    unsigned const N_READS = 2000;
+    for ( bool fast : { false, true } )
+    {
+        QualCompressor qc(fast);
+        qc.setDicts(&dict,&dict);
+        QualCompressor noDict(fast);
+        QualCompressor fewerDict(fast);
+        fewerDict.setDicts(0,&fewer);
+        for ( unsigned idx = 0; idx != N_READS; ++idx )
+        {
+            std::vector<uint8_t> quals;
+            binned(rng,quals);
+            // a quarter of them have a qual that's not in the dictionary
+            bool missing = !(idx % 4);
+            if ( missing )
+                quals[uniform(rng,0,quals.size()-1)] = 30;
+            std::string printable;
+            for ( uint8_t qual : quals )
+                printable.push_back(qual+QUAL_OFFSET);
+            std::vector<char> packed = roundTrip(qc,printable,0,"dict");
+            if ( !packedAs(packed,QualCompressor::DICT) )
+                continue;
+            nDict += 1;
+            if ( missing )
+                fail("dict","a qual that's not in the dictionary was packed as a rank");
+            // ranks of 2 and 3 are beyond the smaller one
+            uint32_t len = printable.size();
+            bool highRank = std::count_if(quals.begin(),quals.end(),
+                                            []( uint8_t qual ) { return qual > 12; });
+            if ( !rejects(noDict,packed,len) || (highRank && !rejects(fewerDict,packed,len)) )
+                fail("dict","a string packed as ranks unpacks without its dictionary");
+        }
+    }
+    if ( nDict < N_READS )
+        fail("dict","only "+std::to_string(nDict)+" reads were packed as ranks");
+    std::cout << "dict: " << 2*N_READS << " reads, " << nDict << " packed as ranks, "
+              << gNFailed-nFailed << " failed" << std::endl;
+}
+
+// rANS round trips, at lengths on either side of a multiple of the 4 states,
+// and with one symbol, or every symbol, or the few of binned quals.  then each
+// coded string is truncated, garbled, and decoded with the wrong count.  those
+// must return false, or at least not crash.
+void checkRans()
+{
+    std::mt19937 rng(4);
+    size_t nFailed = gNFailed;
+    std::vector<std::vector<uint8_t>> inputs(1);
+    for ( unsigned len : { 1, 2, 3, 4, 5, 6, 7, 8, 9, 63, 64, 65, 150, 1001 } )
+    {
+        inputs.push_back(std::vector<uint8_t>(len,37));
+        std::vector<uint8_t> distinct(len);
+        for ( unsigned idx = 0; idx != len; ++idx )
+            distinct[idx] = idx % RansCodec::N_SYMS;
+        std::shuffle(distinct.begin(),distinct.end(),rng);
+        inputs.push_back(distinct);
+        std::vector<uint8_t> quals;
+        while ( quals.size() < len )
+            binned(rng,quals);
+        quals.resize(len);
+        inputs.push_back(quals);
+    }
+
+    RansCodec codec;
+    std::vector<char> coded;
+    std::vector<char> out;
+    for ( std::vector<uint8_t> const& quals : inputs )
+    {
+        unsigned nQuals = quals.size();
+        std::string printable;
+        for ( uint8_t qual : quals )
+            printable.push_back(qual+QUAL_OFFSET);
+        std::string what = " of " + std::to_string(nQuals) + " quals";
+        for ( unsigned order : { 0, 1 } )
+        {
+            std::string name = "order-" + std::to_string(order) + what;
+            coded.clear();
+            if ( order )
+                codec.encode1(quals.data(),nQuals,coded);
+            else
+                codec.encode0(quals.data(),nQuals,coded);
+            if ( !ransDecode(codec,order,coded,coded.size(),nQuals,out) ||
+                    std::string(out.begin(),out.end()) != printable )
+                fail("rANS",name+" doesn't decode to the quals");
+            if ( ransDecode(codec,order,coded,coded.size(),nQuals+1,out) ||
+                    (nQuals && ransDecode(codec,order,coded,coded.size(),nQuals-1,out)) )
+                fail("rANS",name+" decodes with the wrong count");
+            for ( size_t len = 0; len != coded.size(); ++len )
+                if ( ransDecode(codec,order,coded,len,nQuals,out) )
+                    fail("rANS",name+" decodes when truncated to "+std::to_string(len)+" bytes");
+
+            // flip some bits of a byte in the count, the tables, the states,
+            // or the data.  that can, rarely, make another valid string.
+            for ( unsigned idx = 0; idx != 100; ++idx )
+            {
+                std::vector<char> garbled(coded);
+                garbled[uniform(rng,0,garbled.size()-1)] ^= uniform(rng,1,255);
+                ransDecode(codec,order,garbled,garbled.size(),nQuals,out);
+            }
+        }
+    }
+
+    // a count of 0xfffffff0 quals in 25 bytes, which once got that many
+    // allocated.  and random garbage.
+    static char const HUGE[] = "\xf0\xff\xff\xff\x0f\x01\x00" "\x00\x00\x80\x00"
+                               "\x00\x00\x80\x00" "\x00\x00\x80\x00" "\x00\x00\x80\x00";
+    coded.assign(HUGE,HUGE+sizeof(HUGE)-1);
+    if ( ransDecode(codec,0,coded,coded.size(),100,out) )
+        fail("rANS","a huge count was accepted");
+    for ( unsigned idx = 0; idx != 10000; ++idx )
+    {
+        coded.resize(uniform(rng,0,40));
+        for ( char& byte : coded )
+            byte = uniform(rng,0,255);
+        ransDecode(codec,idx&1,coded,coded.size(),uniform(rng,0,20),out);
+    }
+
+    // and through QualCompressor, which uses rANS where it's smaller
+    QualCompressor qc(false,false,true);
+    size_t nRans = 0;
+    for ( std::vector<uint8_t> const& quals : inputs )
+    {
+        std::string printable;
+        for ( uint8_t qual : quals )
+            printable.push_back(qual+QUAL_OFFSET);
+        char const* pQuals = printable.data();
+        uint32_t len = printable.size();
+        std::vector<char> packed;
+        std::vector<size_t> offsets;
+        qc.encode(&pQuals,&len,1,QUAL_OFFSET,packed,offsets);
+        char const* pPacked = packed.data();
+        uint32_t packedLen = packed.size();
+        out.clear();
+        qc.decode(&pPacked,&packedLen,&len,1,QUAL_OFFSET,out,offsets);
+        if ( std::string(out.begin(),out.end()) != printable )
+            fail("rANS","QualCompressor doesn't decode "+std::to_string(len)+" quals");
+        if ( packed.size() < 2 || packed[0] || (packed[1] != QualCompressor::RANS0 &&
+                                                packed[1] != QualCompressor::RANS1) )
+            continue;
+        nRans += 1;
+        if ( !rejects(qc,packed,len+1) )
+            fail("rANS","QualCompressor decodes a rANS string with the wrong count");
+        packed.pop_back();
+        if ( !rejects(qc,packed,len) )
+            fail("rANS","QualCompressor decodes a truncated rANS string");
+    }
+    if ( !nRans )
+        fail("rANS","QualCompressor never chose rANS");
+    std::vector<char> huge(1,0);
+    huge.push_back(QualCompressor::RANS0);
+    huge.insert(huge.end(),HUGE,HUGE+sizeof(HUGE)-1);
+    if ( !rejects(qc,huge,100) )
+        fail("rANS","QualCompressor decodes a huge count");
+    std::cout << "rANS: " << inputs.size() << " inputs, " << nRans << " packed with rANS, "
+              << gNFailed-nFailed << " failed" << std::endl;
+}
+
+// unsorted alignments, percentOQ percent of them with an OQ tag, and some with
+// another tag after it.  the first read of every thousand is a long one.
+std::vector<std::string> taggedAlns( std::mt19937& rng, size_t nAlns, unsigned percentOQ )
+{
+    std::vector<std::string> alns;
+    std::vector<uint8_t> quals;
+    for ( size_t idx = 0; idx != nAlns; ++idx )
+    {
+        std::string printable;
+        quals.clear();
+        while ( quals.size() < (idx % 1000 ? 1 : 20000) )
+            noisy(rng,quals);
+        for ( uint8_t qual : quals )
+            printable.push_back(qual+QUAL_OFFSET);
+        std::string tags;
+        if ( uniform(rng,0,99) < percentOQ )
+        {
+            tags = "OQZ";
+            for ( uint8_t qual : quals )
+                tags.push_back(std::max(2,int(qual)-int(uniform(rng,0,3)))+QUAL_OFFSET);
+            tags.push_back('\0');
+        }
+        if ( uniform(rng,0,1) )
+            tags += std::string("XAC\x07",4);
+        alns.push_back(makeAln(-1,-1,4,{},"t"+std::to_string(idx),printable,tags));
+    }
+    return alns;
+}
+
+// the CRC32 and the length of a list of alignment records, just as they are
+std::pair<uint32_t,uint64_t> recordsCRC( std::vector<std::string> const& alns )
+{
+    uint32_t crc = crc32(0,0,0);
+    uint64_t len = 0;
+    for ( std::string const& rec : alns )
+    {
+        crc = crc32(crc,reinterpret_cast<Bytef const*>(rec.data()),rec.size());
+        len += rec.size();
+    }
+    return std::make_pair(crc,len);
+}
+
+// the CRC32 and the length that --verify reported.  a length of 0 if there's
+// no report.
+std::pair<uint32_t,uint64_t> verifiedCRC( std::string const& err )
+{
+    std::pair<uint32_t,uint64_t> result(0,0);
+    size_t pos = err.find("records CRC32 ");
+    if ( pos != std::string::npos )
+        sscanf(err.c_str()+pos,"records CRC32 %x over %lu",&result.first,&result.second);
+    return result;
+}
+
+// writes an unplaced BAM whose blocks end only between alignments.  or, with
+// every more than 1, only after every every'th alignment, and a block with no
+// such boundary ends where it's full, in the middle of one.
+void writeAlignedBAM( std::string const& file, std::vector<std::string> const& alns,
+                        size_t every = 1 )
+{
+    BAMostream os(file.c_str());
+    os.mSB.setRecordAligned(true);
+    std::string hdr = bamHeader({},"@HD\tVN:1.6\n");
+    os.write(hdr.data(),hdr.size());
+    os.mSB.markBoundary();
+    for ( size_t idx = 0; idx != alns.size(); ++idx )
+    {
+        os.write(alns[idx].data(),alns[idx].size());
+        if ( !((idx+1) % every) )
+            os.mSB.markBoundary();
+    }
+    os.close();
+}
+
+// a BGZF block:  as it's stored, and inflated
+struct RawBlock
+{ std::string mRaw; std::string mData; };
+
+// a BGZF file's blocks.  fails if one is malformed, or its CRC is wrong.
+std::vector<RawBlock> readBlocks( std::string const& file )
+{
+    std::ifstream in(file);
+    std::string bytes((std::istreambuf_iterator<char>(in)),std::istreambuf_iterator<char>());
+    std::vector<RawBlock> blocks;
+    for ( size_t pos = 0; pos != bytes.size(); )
+    {
+        uint16_t bsize;
+        if ( bytes.size() - pos < 26 ||
+                (memcpy(&bsize,&bytes[pos+16],sizeof(bsize)), bytes.size()-pos < bsize+1u) )
+        {
+            fail("blocks",file+" has a truncated block");
+            break;
+        }
+        RawBlock block;
+        block.mRaw = bytes.substr(pos,bsize+1u);
+        pos += bsize + 1u;
+        uint32_t crc, isize;
+        memcpy(&crc,&block.mRaw[block.mRaw.size()-8],sizeof(crc));
+        memcpy(&isize,&block.mRaw[block.mRaw.size()-4],sizeof(isize));
+        block.mData.resize(isize);
+        z_stream zs;
+        memset(&zs,0,sizeof(zs));
+        inflateInit2(&zs,-15);
+        zs.next_in = reinterpret_cast<Bytef*>(&block.mRaw[18]);
+        zs.avail_in = block.mRaw.size() - 26;
+        zs.next_out = reinterpret_cast<Bytef*>(&block.mData[0]);
+        zs.avail_out = isize;
+        int status = inflate(&zs,Z_FINISH);
+        inflateEnd(&zs);
+        if ( status != Z_STREAM_END || zs.avail_out ||
+                crc32(crc32(0,0,0),reinterpret_cast<Bytef const*>(block.mData.data()),isize) != crc )
+            fail("blocks",file+" has a corrupt block");
+        blocks.push_back(block);
+    }
+    return blocks;
+}
+
+// does the data hold whole alignment records, and at least one?
+bool wholeRecords( std::string const& data )
+{
+    size_t pos = 0;
+    while ( data.size() - pos >= sizeof(uint32_t) )
+    {
+        uint32_t blockSize;
+        memcpy(&blockSize,&data[pos],sizeof(blockSize));
+        pos += sizeof(blockSize);
+        if ( data.size() - pos < blockSize )
+            return false; // EARLY RETURN!
+        pos += blockSize;
+    }
+    return pos && pos == data.size();
+}
+
+// converts BAMs with runs of reads with and without OQ tags, with
+// --copy-blocks.  the blocks of whole alignments without OQ or ZQ tags are
+// copied as they are, and no others.  when the input's blocks end only
+// between alignments, every tag-free block is copied.  when they start
+// between alignments, and end in the middle of one, none is.  the output's
+// compression level isn't the input's, so a block that's deflated again
+// doesn't come out the same as one that's copied.
+void checkCopyBlocks()
+{
+    std::mt19937 rng(8);
+    size_t nFailed = gNFailed;
+    std::vector<std::string> alns;
+    for ( unsigned run = 0; run != 8; ++run )
+    {
+        std::vector<std::string> more = taggedAlns(rng,700,run % 2 ? 100 : 0);
+        alns.insert(alns.end(),more.begin(),more.end());
+    }
+    std::string aligned = tmpFile("aligned.bam");
+    std::string sparse = tmpFile("sparse.bam");
+    std::string unaligned = tmpFile("unaligned.bam");
+    std::string out = tmpFile("copied.bam");
+    std::string plain = tmpFile("plain.bam");
+    writeAlignedBAM(aligned,alns);
+    writeAlignedBAM(sparse,alns,500);
+    writeBAM(unaligned,{},alns,false,false,"@HD\tVN:1.6\n");
+
+    size_t nCopied = 0;
+    for ( std::string const& in : { aligned, sparse, unaligned } )
+    {
+        std::vector<RawBlock> inBlocks = readBlocks(in);
+        for ( char const* threads : { "", "-@ 3 " } )
+        {
+            std::string args = std::string(threads) + "-l 1 --copy-blocks " + in + ' ' + out;
+            if ( runOQCompress(args) || runOQCompress(threads+in+' '+plain) )
+            {
+                fail("copy blocks","OQCompress "+args+" failed");
+                continue;
+            }
+            if ( readBAM(out) != readBAM(plain) )
+                fail("copy blocks","OQCompress "+args+" converted differently");
+            std::vector<std::string> outRaws;
+            for ( RawBlock const& block : readBlocks(out) )
+                outRaws.push_back(block.mRaw);
+            std::sort(outRaws.begin(),outRaws.end());
+            for ( RawBlock const& block : inBlocks )
+            {
+                if ( block.mData.empty() )
+                    continue; // the EOF marker
+                bool copyable = wholeRecords(block.mData) &&
+                                    block.mData.find("OQZ") == std::string::npos &&
+                                    block.mData.find("ZQB") == std::string::npos;
+                bool copied = std::binary_search(outRaws.begin(),outRaws.end(),block.mRaw);
+                nCopied += copied;
+                if ( copied && !copyable )
+                    fail("copy blocks","OQCompress "+args+" copied a block it shouldn't have");
+                else if ( copyable && !copied && in == aligned )
+                    fail("copy blocks","OQCompress "+args+" didn't copy a block it could have");
+            }
+        }
+    }
+    if ( !nCopied )
+        fail("copy blocks","no blocks were copied");
+    std::cout << "copy blocks: " << nCopied << " blocks copied, " << gNFailed-nFailed
+              << " failed" << std::endl;
+}
+
+// converts a BAM with OQ tags, and some reads too long for a block, with
+// --aligned-blocks, and then back again.  every block must end between
+// alignments (or the header and an alignment), except those that end in the
+// middle of an alignment too big for a block.
+void checkAlignedBlocks()
+{
+    std::mt19937 rng(9);
+    size_t nFailed = gNFailed;
+    std::vector<std::string> alns = taggedAlns(rng,3000,50);
+    for ( unsigned idx = 0; idx != 3; ++idx )
+    {
+        std::string quals(50000+idx,'I');
+        std::string tags = "OQZ" + std::string(quals.size(),'5') + '\0';
+        alns.insert(alns.begin()+uniform(rng,0,alns.size()),
+                    makeAln(-1,-1,4,{},"long"+std::to_string(idx),quals,tags));
+    }
+    std::string in = tmpFile("unaligned.bam");
+    std::string zq = tmpFile("aligned.bam");
+    std::string back = tmpFile("realigned.bam");
+    std::string plain = tmpFile("plain.bam");
+    writeBAM(in,{},alns,false,false,"@HD\tVN:1.6\n");
+
+    size_t nBlocks = 0;
+    size_t nSplit = 0;
+    auto check = [&]( std::string const& args, std::string const& out )
+    {
+        std::vector<RawBlock> blocks = readBlocks(out);
+        std::string header = bamHeader({},"@HD\tVN:1.6\n");
+        size_t recStart = header.size();
+        size_t recEnd = recStart;
+        size_t dataEnd = 0;
+        std::string data;
+        for ( RawBlock const& block : blocks )
+            data += block.mData;
+        for ( RawBlock const& block : blocks )
+        {
+            dataEnd += block.mData.size();
+            if ( block.mData.empty() || dataEnd == data.size() )
+                continue;
+            nBlocks += 1;
+            if ( dataEnd < header.size() )
+            {
+                fail("aligned blocks","OQCompress "+args+" split the header");
+                continue;
+            }
+            // find the alignment that holds the block's end
+            while ( recEnd <= dataEnd )
+            {
+                recStart = recEnd;
+                uint32_t blockSize;
+                memcpy(&blockSize,&data[recStart],sizeof(blockSize));
+                recEnd = recStart + sizeof(blockSize) + blockSize;
+            }
+            if ( dataEnd == recStart )
+                continue;
+            nSplit += 1;
+            if ( recEnd - recStart <= BGZFBlock::MAX_INPUT_SIZE )
+                fail("aligned blocks","OQCompress "+args+" split an alignment that fits a block");
+        }
+    };
+    for ( char const* opts : { "", "-@ 3 ", "-l 0 ", "--copy-blocks -@ 2 " } )
+    {
+        std::string args = std::string(opts) + "--aligned-blocks " + in + ' ' + zq;
+        std::string backArgs = std::string(opts) + "--aligned-blocks " + zq + ' ' + back;
+        if ( runOQCompress(args) || runOQCompress(backArgs) || runOQCompress(in+' '+plain) )
+        {
+            fail("aligned blocks","OQCompress "+args+" failed");
+            continue;
+        }
+        if ( readBAM(zq) != readBAM(plain) || readBAM(back) != alns )
+            fail("aligned blocks","OQCompress "+args+" converted differently");
+        check(args,zq);
+        check(backArgs,back);
+    }
+    if ( !nSplit )
+        fail("aligned blocks","no alignment too big for a block was split");
+    std::cout << "aligned blocks: " << nBlocks << " blocks, " << nSplit
+              << " ending inside an alignment, " << gNFailed-nFailed << " failed" << std::endl;
+}
+
+// converts a BAM with OQ tags, and back, with --verify, with and without
+// threads.  the checksums must match each other, and the records' own, which
+// makes sure they were combined in order.
+void checkVerify()
+{
+    std::mt19937 rng(7);
+    size_t nFailed = gNFailed;
+    std::vector<std::string> alns = taggedAlns(rng,10000,70);
+    std::string oq = tmpFile("oq.bam");
+    std::string zq = tmpFile("zq.bam");
+    std::string back = tmpFile("back.bam");
+    writeBAM(oq,{},alns,false,false,"@HD\tVN:1.6\n");
+    std::pair<uint32_t,uint64_t> expected = recordsCRC(alns);
+    unsigned nRuns = 0;
+    for ( char const* opts : { "--verify ", "--verify -@ 3 ", "--verify --delta --rans ",
+                               "--verify --dict -@ 2 " } )
+    {
+        std::string err;
+        nRuns += 2;
+        if ( runOQCompress(opts+oq+' '+zq,&err) )
+            fail("verify",std::string("OQCompress ")+opts+"failed converting OQ to ZQ");
+        else if ( verifiedCRC(err) != expected )
+            fail("verify",std::string("OQCompress ")+opts+"reported the wrong CRC for OQ to ZQ");
+        if ( runOQCompress(opts+zq+' '+back,&err) )
+            fail("verify",std::string("OQCompress ")+opts+"failed converting ZQ to OQ");
+        else if ( verifiedCRC(err) != expected )
+            fail("verify",std::string("OQCompress ")+opts+"reported the wrong CRC for ZQ to OQ");
+        else if ( readBAM(back) != alns )
+            fail("verify",std::string("OQCompress ")+opts+"didn't convert back to the original");
+    }
+    std::cout << "verify: " << nRuns << " conversions, " << gNFailed-nFailed << " failed"
+              << std::endl;
+}
+
+} // end of anonymous namespace
+
+int main( int argc, char** argv )
+{
+    if ( argc > 1 && argv[1][0] == '-' )
+    {
+        std::cout << "Usage: OQTest [file.bam ...]\n"
+                     "Checks the quality block partitioning against a brute-force\n"
+                     "reference on synthetic quals, and on the QUAL fields of the BAMs."
+                  << std::endl;
+        exit(1);
+    }
+
+    Checker checker;
+    checkFixed(checker);
+    checkSynthetic(checker);
+    for ( int idx = 1; idx < argc; ++idx )
+        checkBAM(checker,argv[idx]);
+
+    char tmpDir[] = "/tmp/OQTest.XXXXXX";
+    if ( !mkdtemp(tmpDir) )
+    {
+        std::cout << "Can't make a scratch directory" << std::endl;
+        exit(1);
+    }
+    gTmpDir = tmpDir;
+    checkDelta();
+    checkDict();
+    checkRans();
+    checkIndexes();
+    checkRegions();
+    checkVerify();
+    checkCopyBlocks();
+    checkAlignedBlocks();
+    if ( system(("rm -rf " + gTmpDir).c_str()) )
+        std::cout << "Can't remove " << gTmpDir << std::endl;
+
+    if ( Checker::mNFailedTotal || gNFailed )
+    {
+        std::cout << Checker::mNFailedTotal << " of " << Checker::mNVecsTotal
+                  << " qual vectors and " << gNFailed << " other checks failed" << std::endl;
+        exit(1);
+    }
+    std::cout << "All " << Checker::mNVecsTotal << " qual vectors and the other checks OK"
+              << std::endl;
+}
@@ -0,0 +1,509 @@
+/*
+ * QualCompressor.cc
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include "QualCompressor.h"
+#include "Stats.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <stdlib.h>
+
+#ifdef __BMI2__
+uint64_t const QualCompressor::UNPACK_MASKS[8] =
+{ 0x0000000000000000ul, 0x0101010101010101ul, 0x0303030303030303ul, 0x0707070707070707ul,
+  0x0f0f0f0f0f0f0f0ful, 0x1f1f1f1f1f1f1f1ful, 0x3f3f3f3f3f3f3f3ful, 0x7f7f7f7f7f7f7f7ful };
+#endif
+
+void QualCompressor::badQual( unsigned val )
+{
+    throw std::runtime_error("Your input reads are funny.  I found a quality score of " +
+                                std::to_string(val) + ".  The maximum value that I allow is " +
+                                std::to_string(MAX_Q) + '.');
+}
+
+void QualCompressor::badPacking( char const* why )
+{
+    throw std::runtime_error(std::string("Can't unpack a ZQ tag:  ") + why + '.');
+}
+
+// finds the partition into blocks that minimizes packedSize, by dynamic programming.
+// mCosts[j] is the least cost of packing the first j quals, and the best block
+// ending at pos starts at the j that minimizes mCosts[j] + blockSize(pos+1-j,bits),
+// where bits is the width needed for the range of quals from j through pos.
+// mLastBlocks[pos] remembers that block.
+//
+// mMins[j] and mMaxs[j] hold that range, and are brought up to date as pos
+// advances, so scoring a start involves no searching and no branches.  we score
+// 8 starts at a time under AVX2.  for noisy quals, which are the slow case, the
+// best block usually starts far back, so there's nothing to be gained by trying
+// to cut the scan short.
+void QualCompressor::configureBlocks( uint8_t const* qs, unsigned nQuals, unsigned offset )
+{
+    mBlocks.clear();
+    // the slack at the end lets us score 8 starts at a time without a tail
+    mCosts.resize(nQuals+1+8);
+    mCosts[0] = 0; // cost of an empty compressed qual vector
+    mMins.resize(nQuals+8);
+    mMaxs.resize(nQuals+8);
+    mLastBlocks.clear();
+    mLastBlocks.reserve(nQuals);
+
+    unsigned* costs = mCosts.data();
+    uint32_t* mins = mMins.data();
+    uint32_t* maxs = mMaxs.data();
+    for ( unsigned pos = 0; pos != nQuals; ++pos )
+    {
+        unsigned val = qs[pos];
+        checkQual(uint8_t(val-offset));
+        mins[pos] = maxs[pos] = val;
+
+        // blocks hold at most 255 quals, so first is the earliest start.  the
+        // key for each start is its cost (less baseCost) in the high bits, and
+        // the block length in the low byte, so the shortest of equally good
+        // blocks wins.
+        unsigned first = pos >= MAX_BLOCK_QS-1 ? pos - (MAX_BLOCK_QS-1) : 0;
+        unsigned baseCost = costs[first];
+        unsigned end = pos + 1;
+        uint32_t key = ~0u;
+#ifdef __AVX2__
+        __m256i vals = _mm256_set1_epi32(val);
+        __m256i bases = _mm256_set1_epi32(baseCost);
+        __m256i hdrBits = _mm256_set1_epi32(17+7);
+        __m256i expBias = _mm256_set1_epi32(126);
+        __m256i zeros = _mm256_setzero_si256();
+        __m256i nQs = _mm256_sub_epi32(_mm256_set1_epi32(end-first),
+                                        _mm256_setr_epi32(0,1,2,3,4,5,6,7));
+        __m256i ones = _mm256_set1_epi32(1);
+        __m256i eights = _mm256_set1_epi32(8);
+        __m256i keys = _mm256_set1_epi32(-1);
+        for ( unsigned start = first; start < end; start += 8 )
+        {
+            __m256i* pMins = reinterpret_cast<__m256i*>(mins+start);
+            __m256i* pMaxs = reinterpret_cast<__m256i*>(maxs+start);
+            __m256i lo = _mm256_min_epu32(_mm256_loadu_si256(pMins),vals);
+            __m256i hi = _mm256_max_epu32(_mm256_loadu_si256(pMaxs),vals);
+            _mm256_storeu_si256(pMins,lo);
+            _mm256_storeu_si256(pMaxs,hi);
+
+            // the number of bits in the range is 1 more than the exponent of
+            // its float conversion, for all but a range of 0
+            __m256i range = _mm256_sub_epi32(hi,lo);
+            __m256i exps = _mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(range)),23);
+            __m256i bits = _mm256_max_epi32(_mm256_sub_epi32(exps,expBias),zeros);
+
+            __m256i prevCosts = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(costs+start));
+            __m256i blkSizes = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(nQs,bits),hdrBits),3);
+            __m256i curCosts = _mm256_add_epi32(_mm256_sub_epi32(prevCosts,bases),blkSizes);
+            __m256i curKeys = _mm256_or_si256(_mm256_slli_epi32(curCosts,8),nQs);
+
+            // starts past pos have no block
+            curKeys = _mm256_or_si256(curKeys,_mm256_cmpgt_epi32(ones,nQs));
+            keys = _mm256_min_epu32(keys,curKeys);
+            nQs = _mm256_sub_epi32(nQs,eights);
+        }
+        __m128i keys4 = _mm_min_epu32(_mm256_castsi256_si128(keys),_mm256_extracti128_si256(keys,1));
+        keys4 = _mm_min_epu32(keys4,_mm_shuffle_epi32(keys4,0x4e));
+        keys4 = _mm_min_epu32(keys4,_mm_shuffle_epi32(keys4,0xb1));
+        key = _mm_cvtsi128_si32(keys4);
+#else
+        for ( unsigned start = first; start != end; ++start )
+        {
+            mins[start] = std::min(mins[start],val);
+            maxs[start] = std::max(maxs[start],val);
+            unsigned bits = ceilLg2(maxs[start]+1u-mins[start]);
+            uint32_t curCost = costs[start] - baseCost + Block::blockSize(end-start,bits);
+            key = std::min(key,curCost << 8 | (end-start));
+        }
+#endif
+        costs[end] = baseCost + (key >> 8);
+        unsigned start = end - (key & 0xff);
+        mLastBlocks.push_back(Block(end-start,ceilLg2(maxs[start]+1u-mins[start]),
+                                    mins[start]-offset));
+    }
+
+    // trace the best partition back from the end
+    for ( unsigned pos = nQuals; pos; pos -= mBlocks.back().mNQs )
+        mBlocks.push_back(mLastBlocks[pos-1]);
+    std::reverse(mBlocks.begin(),mBlocks.end());
+}
+
+// partitions the quals greedily in one pass.  each block starts with a run of
+// equal quals, and swallows the runs that follow for as long as that's no more
+// costly than ending the block there and starting a new one.
+void QualCompressor::configureBlocksFast( uint8_t const* qs, unsigned nQuals, unsigned offset )
+{
+    mBlocks.clear();
+    uint8_t const* itr = qs;
+    uint8_t const* end = qs + nQuals;
+    while ( itr != end )
+    {
+        unsigned minVal = *itr;
+        unsigned maxVal = minVal;
+        unsigned bits = 0;
+        unsigned nQs = 0;
+        while ( itr != end && nQs < MAX_BLOCK_QS )
+        {
+            unsigned val = *itr;
+            checkQual(uint8_t(val-offset));
+            unsigned runLen = 1;
+            while ( itr + runLen != end && itr[runLen] == val &&
+                        nQs + runLen < MAX_BLOCK_QS )
+                runLen += 1;
+            unsigned newMin = std::min(minVal,val);
+            unsigned newMax = std::max(maxVal,val);
+            unsigned newBits = ceilLg2(newMax+1u-newMin);
+            if ( nQs && Block::blockSize(nQs+runLen,newBits) >
+                            Block::blockSize(nQs,bits) + Block::blockSize(runLen,0) )
+                break;
+            minVal = newMin;
+            maxVal = newMax;
+            bits = newBits;
+            nQs += runLen;
+            itr += runLen;
+        }
+        mBlocks.push_back(Block(nQs,bits,minVal-offset));
+    }
+}
+
+// every qual string's blocks are chosen first, and then they're all packed, so
+// that each stage's timer runs just once for the batch
+void QualCompressor::encode( char const* const* quals, uint32_t const* lens, size_t n,
+                                unsigned offset, std::vector<char>& out,
+                                std::vector<size_t>& offsets, Recal const* recals )
+{
+    mPlans.resize(n);
+    mPlanBlocks.clear();
+    { Stats::Timer timer(Stats::CONFIGURE_BLOCKS);
+      for ( size_t idx = 0; idx != n; ++idx )
+      {
+          Plan& plan = mPlans[idx];
+          plan.mCodec = chooseBlocks(reinterpret_cast<uint8_t const*>(quals[idx]),lens[idx],
+                                        offset,recals ? recals+idx : 0);
+          plan.mFirstBlock = mPlanBlocks.size();
+          mPlanBlocks.insert(mPlanBlocks.end(),mBlocks.begin(),mBlocks.end());
+      } }
+
+    // the codecs used are counted here, and added to the stats once
+    Stats::Timer timer(Stats::ENCODE);
+    size_t nCodecs[DICT+1] = {};
+    offsets.resize(n+1);
+    for ( size_t idx = 0; idx != n; ++idx )
+    {
+        offsets[idx] = out.size();
+        Plan const& plan = mPlans[idx];
+        size_t endBlock = idx+1 < n ? mPlans[idx+1].mFirstBlock : mPlanBlocks.size();
+        mBlocks.assign(mPlanBlocks.begin()+plan.mFirstBlock,mPlanBlocks.begin()+endBlock);
+        nCodecs[encode(reinterpret_cast<uint8_t const*>(quals[idx]),lens[idx],offset,
+                        recals ? recals+idx : 0,plan.mCodec,out)] += 1;
+    }
+    offsets[n] = out.size();
+    Stats::count(Stats::DELTA_TAGS,nCodecs[DELTA_QUAL]);
+    Stats::count(Stats::RANS_TAGS,nCodecs[RANS0]+nCodecs[RANS1]);
+    Stats::count(Stats::DICT_TAGS,nCodecs[DICT]);
+}
+
+void QualCompressor::decode( char const* const* packed, uint32_t const* lens,
+                                uint32_t const* nQuals, size_t n, unsigned offset,
+                                std::vector<char>& out, std::vector<size_t>& offsets,
+                                Recal const* recals )
+{
+    Stats::Timer timer(Stats::DECODE);
+    offsets.resize(n+1);
+    for ( size_t idx = 0; idx != n; ++idx )
+    {
+        offsets[idx] = out.size();
+        decode(reinterpret_cast<uint8_t const*>(packed[idx]),lens[idx],nQuals[idx],offset,
+                recals ? recals+idx : 0,out);
+        if ( out.size() - offsets[idx] != nQuals[idx] )
+            badPacking("it doesn't have a qual for each base of its read");
+    }
+    offsets[n] = out.size();
+}
+
+size_t QualCompressor::plan( char const* quals, uint32_t len, unsigned offset )
+{
+    uint8_t const* qs = reinterpret_cast<uint8_t const*>(quals);
+    if ( mFast )
+        configureBlocksFast(qs,len,offset);
+    else
+        configureBlocks(qs,len,offset);
+    return packedSize() + 1;
+}
+
+bool QualCompressor::makeRanks( uint8_t const* quals, unsigned nQuals, unsigned offset )
+{
+    mRanks.resize(nQuals);
+    for ( unsigned idx = 0; idx != nQuals; ++idx )
+    {
+        uint8_t rank = mpEncodeDict->rank(uint8_t(quals[idx]-offset));
+        if ( rank == QualDict::NONE )
+            return false; // EARLY RETURN!
+        mRanks[idx] = rank;
+    }
+    return true;
+}
+
+bool QualCompressor::makeResiduals( uint8_t const* quals, unsigned nQuals, unsigned offset,
+                                    Recal const& recal )
+{
+    if ( !recal.mQuals || recal.mLen != nQuals )
+        return false; // EARLY RETURN!
+    uint8_t const* recals = reinterpret_cast<uint8_t const*>(recal.mQuals);
+    mResiduals.resize(nQuals);
+    for ( unsigned idx = 0; idx != nQuals; ++idx )
+    {
+        int residual = int(quals[idx]) - int(offset) - recals[idx] + int(DELTA_BIAS);
+        if ( residual < 0 || residual > int(MAX_Q) )
+            return false; // EARLY RETURN!
+        mResiduals[idx] = residual;
+    }
+    return true;
+}
+
+// the quals are partitioned as they are, and, in delta mode, as residuals, and,
+// with a dictionary, as ranks.  we keep whichever packs smallest, counting the 2
+// bytes of codec marker, in mBlocks, and return its codec.
+QualCompressor::Codec QualCompressor::chooseBlocks( uint8_t const* quals, unsigned nQuals,
+                                                    unsigned offset, Recal const* pRecal )
+{
+    // in fast mode, every SAMPLE_INTERVAL'th qual string is also partitioned
+    // optimally.  only the quals as they are count, not residuals or ranks.
+    Codec codec = BLOCKS;
+    if ( !mFast )
+        configureBlocks(quals,nQuals,offset);
+    else if ( ++mNEncoded % SAMPLE_INTERVAL )
+        configureBlocksFast(quals,nQuals,offset);
+    else
+    {
+        configureBlocks(quals,nQuals,offset);
+        mSample.mNQualVecs += 1;
+        mSample.mOptimalSize += packedSize() + 1;
+        configureBlocksFast(quals,nQuals,offset);
+        mSample.mFastSize += packedSize() + 1;
+    }
+    if ( mDelta && pRecal && makeResiduals(quals,nQuals,offset,*pRecal) &&
+            tryBlocks(mResiduals.data(),nQuals,codec) )
+        codec = DELTA_QUAL;
+    if ( mpEncodeDict && makeRanks(quals,nQuals,offset) &&
+            tryBlocks(mRanks.data(),nQuals,codec) )
+        codec = DICT;
+    return codec;
+}
+
+// packs the quals into the blocks in mBlocks, which chooseBlocks chose for
+// codec.  in rANS mode, they're also entropy coded, and that's kept if it's
+// smaller.  returns the codec used.
+QualCompressor::Codec QualCompressor::encode( uint8_t const* quals, unsigned nQuals,
+                                                unsigned offset, Recal const* pRecal,
+                                                Codec codec, std::vector<char>& out )
+{
+    if ( mRans && nQuals )
+    {
+        // chooseBlocks has already checked the quals
+        mVals.resize(nQuals);
+        for ( unsigned idx = 0; idx != nQuals; ++idx )
+            mVals[idx] = quals[idx] - offset;
+        for ( std::vector<char>& coded : mCoded )
+        {
+            coded.clear();
+            coded.push_back(0);
+            coded.push_back(&coded == mCoded ? RANS0 : RANS1);
+        }
+        mRansCodec.encode0(mVals.data(),nQuals,mCoded[0]);
+        mRansCodec.encode1(mVals.data(),nQuals,mCoded[1]);
+        std::vector<char> const& best =
+                mCoded[0].size() <= mCoded[1].size() ? mCoded[0] : mCoded[1];
+        if ( best.size() < packedSize() + (codec == BLOCKS ? 1 : 3) )
+        {
+            out.insert(out.end(),best.begin(),best.end());
+            return Codec(best[1]); // EARLY RETURN!
+        }
+    }
+
+    if ( codec == BLOCKS )
+        pack(quals,nQuals,offset,out);
+    else
+    {
+        // the residuals or ranks have been made again for other reads since
+        // chooseBlocks made these ones
+        if ( codec == DELTA_QUAL )
+            makeResiduals(quals,nQuals,offset,*pRecal);
+        else
+            makeRanks(quals,nQuals,offset);
+        out.push_back(0);
+        out.push_back(codec);
+        pack(codec == DELTA_QUAL ? mResiduals.data() : mRanks.data(),nQuals,0,out);
+    }
+    return codec;
+}
+
+// partitions vals, which have no offset, and keeps the partition if it packs
+// smaller than the one in mBlocks, which was made for codec.  returns true if
+// it was kept.
+bool QualCompressor::tryBlocks( uint8_t const* vals, unsigned nQuals, Codec codec )
+{
+    size_t bestSize = packedSize() + (codec == BLOCKS ? 0 : 2);
+    mSavedBlocks.swap(mBlocks);
+    if ( mFast )
+        configureBlocksFast(vals,nQuals,0);
+    else
+        configureBlocks(vals,nQuals,0);
+    if ( packedSize() + 2 < bestSize )
+        return true; // EARLY RETURN!
+    mBlocks.swap(mSavedBlocks);
+    return false;
+}
+
+// packs the quals into the blocks in mBlocks
+void QualCompressor::pack( uint8_t const* quals, unsigned nQuals, unsigned offset,
+                            std::vector<char>& out )
+{
+    // the slack at the end lets us store 8 bytes at a time
+    size_t outIdx = out.size();
+    size_t size = packedSize() + 1;
+    out.resize(outIdx+size+8);
+    uint8_t* pOut = reinterpret_cast<uint8_t*>(&out[outIdx]);
+    uint8_t const* itr = quals;
+    uint8_t const* end = quals + nQuals;
+    for ( Block const& block : mBlocks )
+    {
+        unsigned nQs = block.mNQs;
+        unsigned nBits = block.mBits;
+        uint64_t minQ = block.mMinQ;
+        *pOut++ = nQs;
+
+        // bits accumulates the bitstream until there are whole bytes to store.
+        // quals are at most 63, so nBits is at most 6, and bits never has to
+        // hold more than 9+8*6 bits.
+        uint64_t bits = nBits | minQ << 3;
+        unsigned nBitsHeld = 9;
+        if ( nBits )
+        {
+            uint64_t minQs = (minQ + offset) * 0x0101010101010101ul;
+            for ( unsigned done = 0; done < nQs; done += 8 )
+            {
+                uint64_t vals = pack8(load64(itr+done,end)-minQs,nBits);
+                unsigned nVals = nQs - done;
+                if ( nVals < 8 ) // clear the bits that belong to the next block
+                    vals &= (1ul << nVals*nBits) - 1ul;
+                else
+                    nVals = 8;
+                bits |= vals << nBitsHeld;
+                nBitsHeld += nVals*nBits;
+                memcpy(pOut,&bits,sizeof(bits));
+                pOut += nBitsHeld >> 3;
+                bits >>= nBitsHeld & ~7u;
+                nBitsHeld &= 7;
+            }
+        }
+        memcpy(pOut,&bits,sizeof(bits));
+        pOut += (nBitsHeld+7) >> 3;
+        itr += nQs;
+    }
+    *pOut = 0;
+    out.resize(outIdx+size);
+}
+
+// the rANS codecs check nQuals before they decode anything, since their counts
+// are varints that could be anything.  the others unpack at most a few hundred
+// quals per packed byte, and nQuals is checked afterwards.
+void QualCompressor::decode( uint8_t const* packed, unsigned len, unsigned nQuals,
+                                unsigned offset, Recal const* pRecal, std::vector<char>& out )
+{
+    if ( len < 2 || packed[0] )
+    {
+        unpack(packed,len,offset,out);
+        return; // EARLY RETURN!
+    }
+    if ( packed[1] == RANS0 || packed[1] == RANS1 )
+    {
+        bool ok = packed[1] == RANS0 ?
+                        mRansCodec.decode0(packed+2,len-2,nQuals,offset,out) :
+                        mRansCodec.decode1(packed+2,len-2,nQuals,offset,out);
+        if ( !ok )
+            badPacking("its rANS data is corrupt");
+        return; // EARLY RETURN!
+    }
+    if ( packed[1] == DICT )
+    {
+        // unpack the ranks, and look up their quals
+        if ( !mpDecodeDict )
+            badPacking("it was packed with a qual dictionary, and the header has none");
+        size_t outIdx = out.size();
+        unpack(packed+2,len-2,0,out);
+        QualDict const& dict = *mpDecodeDict;
+        for ( auto itr = out.begin()+outIdx; itr != out.end(); ++itr )
+        {
+            uint8_t rank = *itr;
+            if ( rank >= dict.size() )
+                badPacking("it has a qual that's not in the header's qual dictionary");
+            *itr = dict.qual(rank) + offset;
+        }
+        return; // EARLY RETURN!
+    }
+    if ( packed[1] != DELTA_QUAL )
+        badPacking("it uses an unknown codec");
+
+    // unpack the residuals, and add back the recalibrated quals
+    if ( !pRecal || !pRecal->mQuals )
+        badPacking("it was packed against QUAL, and the read has none");
+    size_t outIdx = out.size();
+    unpack(packed+2,len-2,0,out);
+    if ( out.size() - outIdx != pRecal->mLen )
+        badPacking("it was packed against a QUAL of a different length");
+    uint8_t const* recals = reinterpret_cast<uint8_t const*>(pRecal->mQuals);
+    uint8_t* itr = reinterpret_cast<uint8_t*>(&out[outIdx]);
+    uint8_t bias = offset - DELTA_BIAS;
+    for ( unsigned idx = 0; idx != pRecal->mLen; ++idx )
+        itr[idx] += recals[idx] + bias;
+}
+
+// unpacks a series of blocks
+void QualCompressor::unpack( uint8_t const* packed, unsigned len, unsigned offset,
+                                std::vector<char>& out )
+{
+    uint8_t const* end = packed + len;
+
+    // walk the block headers to find out how many quals there are
+    size_t nQuals = 0;
+    for ( uint8_t const* itr = packed; itr < end && *itr; )
+    {
+        unsigned nQs = *itr;
+        unsigned nBits = itr + 1 < end ? itr[1] & 0x07 : 0;
+        nQuals += nQs;
+        itr += Block::blockSize(nQs,nBits);
+    }
+
+    // unpack 8 quals at a time.  the slack at the end lets us store all 8 even
+    // when we're at the tail of the last block.
+    size_t outIdx = out.size();
+    out.resize(outIdx+nQuals+8);
+    char* pOut = &out[outIdx];
+    for ( uint8_t const* itr = packed; itr < end && *itr; )
+    {
+        unsigned nQs = *itr++;
+        uint64_t header = load64(itr,end);
+        unsigned nBits = header & 0x07;
+        uint64_t minQ = ((header >> 3) & 0x3f) + offset;
+        if ( !nBits )
+            memset(pOut,minQ,nQs);
+        else
+        {
+            uint64_t minQs = minQ * 0x0101010101010101ul;
+            uint64_t bitOff = 9;
+            for ( unsigned done = 0; done < nQs; done += 8 )
+            {
+                uint64_t vals = load64(itr+(bitOff>>3),end) >> (bitOff&7);
+                vals = unpack8(vals,nBits) + minQs;
+                memcpy(pOut+done,&vals,sizeof(vals));
+                bitOff += 8*nBits;
+            }
+        }
+        pOut += nQs;
+        itr += Block::blockSize(nQs,nBits) - 1;
+    }
+    out.resize(outIdx+nQuals);
+}
@@ -0,0 +1,214 @@
+/*
+ * QualCompressor.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef QUALCOMPRESSOR_H_
+#define QUALCOMPRESSOR_H_
+
+#include "QualDict.h"
+#include "RansCodec.h"
+#include <numeric>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__BMI2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// class to do quality score compression and decompression
+class QualCompressor
+{
+public:
+    // in fast mode, blocks are chosen greedily in one pass rather than optimally.
+    // the packed format is the same either way.  in delta mode, a qual string
+    // is packed as its differences from a read's recalibrated quals, when
+    // that's smaller.  in rANS mode, a qual string is entropy coded instead,
+    // when that's smaller still.
+    explicit QualCompressor( bool fast = false, bool delta = false, bool rans = false )
+    : mFast(fast), mDelta(delta), mRans(rans), mpEncodeDict(0), mpDecodeDict(0),
+      mNEncoded(0) {}
+    QualCompressor( QualCompressor const& )=delete;
+    QualCompressor& operator=( QualCompressor const& )=delete;
+
+    // with an encoding dictionary, a qual string is packed as its ranks, when
+    // that's smaller.  strings packed that way need the same dictionary to
+    // decode.  either may be null, and they must outlive this.
+    void setDicts( QualDict const* pEncodeDict, QualDict const* pDecodeDict )
+    { mpEncodeDict = pEncodeDict; mpDecodeDict = pDecodeDict; }
+
+    // a read's recalibrated quals (its QUAL field:  raw scores, with no offset),
+    // which a qual string can be packed against.  mQuals is null if it has none.
+    struct Recal
+    { Recal() : mQuals(0), mLen(0) {}
+      Recal( char const* quals, uint32_t len ) : mQuals(quals), mLen(len) {}
+      char const* mQuals; uint32_t mLen; };
+
+    // packs n qual strings.  the idx'th has lens[idx] quals at quals[idx], each of
+    // them offset more than its score (33, for SAM's printable quals).  the packed
+    // strings are appended to out, and offsets gets n+1 entries:  the idx'th packed
+    // string runs from out[offsets[idx]] up to out[offsets[idx+1]].  in delta mode,
+    // recals[idx], if recals is given, is what the idx'th may be packed against.
+    void encode( char const* const* quals, uint32_t const* lens, size_t n,
+                    unsigned offset, std::vector<char>& out, std::vector<size_t>& offsets,
+                    Recal const* recals = 0 );
+
+    // the reverse:  unpacks n packed qual strings, the idx'th of which is the
+    // lens[idx] bytes at packed[idx], adding offset to each qual.  it must unpack
+    // to nQuals[idx] quals (its read's length), or it's rejected as corrupt.
+    // strings that were packed against recalibrated quals need recals, just as
+    // for encode.
+    void decode( char const* const* packed, uint32_t const* lens, uint32_t const* nQuals,
+                    size_t n, unsigned offset, std::vector<char>& out,
+                    std::vector<size_t>& offsets, Recal const* recals = 0 );
+
+    // chooses blocks for len quals just as encode would, but returns the size
+    // of the packed string instead of packing it
+    size_t plan( char const* quals, uint32_t len, unsigned offset );
+
+    // in fast mode, every SAMPLE_INTERVAL'th qual vector is also partitioned
+    // optimally, so we can say how much the greedy partitioning is costing us
+    struct Sample
+    { Sample() : mNQualVecs(0), mFastSize(0), mOptimalSize(0) {}
+      Sample& operator+=( Sample const& that )
+      { mNQualVecs += that.mNQualVecs; mFastSize += that.mFastSize;
+        mOptimalSize += that.mOptimalSize; return *this; }
+      size_t mNQualVecs; size_t mFastSize; size_t mOptimalSize; };
+    Sample const& getSample() const { return mSample; }
+
+    static unsigned const SAMPLE_INTERVAL = 64;
+
+    // a packed string is a series of blocks, ended by a 0.  one that starts
+    // with the 0, and has more after it, has a codec byte next, saying how the
+    // rest is packed.
+    enum Codec : uint8_t
+    { BLOCKS = 0, // plain blocks, which have no marker
+      DELTA_QUAL = 1, // blocks of OQ - QUAL + DELTA_BIAS
+      RANS0 = 2, // order-0 rANS (see RansCodec)
+      RANS1 = 3, // order-1 rANS
+      DICT = 4 }; // blocks of ranks in the header's QualDict
+
+    static unsigned const DELTA_BIAS = 32;
+
+private:
+    size_t packedSize() const
+    { return std::accumulate(mBlocks.begin(),mBlocks.end(),0ul,
+           []( size_t acc, Block const& blk ) { return acc+blk.size(); }); }
+
+    Codec chooseBlocks( uint8_t const* quals, unsigned nQuals, unsigned offset,
+                        Recal const* pRecal );
+    Codec encode( uint8_t const* quals, unsigned nQuals, unsigned offset, Recal const* pRecal,
+                    Codec codec, std::vector<char>& out );
+    void decode( uint8_t const* packed, unsigned len, unsigned nQuals, unsigned offset,
+                    Recal const* pRecal, std::vector<char>& out );
+
+    // fills mResiduals with the quals' differences from their recalibrated
+    // values, plus DELTA_BIAS.  returns false if some difference won't fit.
+    bool makeResiduals( uint8_t const* quals, unsigned nQuals, unsigned offset,
+                        Recal const& recal );
+
+    // fills mRanks with the quals' ranks in the encoding dictionary.  returns
+    // false if some qual isn't in it.
+    bool makeRanks( uint8_t const* quals, unsigned nQuals, unsigned offset );
+
+    bool tryBlocks( uint8_t const* vals, unsigned nQuals, Codec codec );
+
+    void pack( uint8_t const* quals, unsigned nQuals, unsigned offset, std::vector<char>& out );
+    void unpack( uint8_t const* packed, unsigned len, unsigned offset, std::vector<char>& out );
+
+    void configureBlocks( uint8_t const* qs, unsigned nQuals, unsigned offset );
+    void configureBlocksFast( uint8_t const* qs, unsigned nQuals, unsigned offset );
+
+    static void checkQual( unsigned val )
+    { if ( val > MAX_Q ) badQual(val); }
+    static void badQual( unsigned val );
+    static void badPacking( char const* why );
+
+    static unsigned const MAX_Q = 63;
+    static unsigned const MAX_BLOCK_QS = 255;
+
+    static int nlz( uint32_t val )
+    { return val ? __builtin_clz(val) : 32; }
+
+    static int ceilLg2( uint32_t val )
+    { return 32-nlz(val-1); }
+
+    // little-endian load of the 8 bytes at ptr, with zeros for anything past end
+    static uint64_t load64( uint8_t const* ptr, uint8_t const* end )
+    { uint64_t val = 0;
+      if ( end - ptr >= 8 ) memcpy(&val,ptr,sizeof(val));
+      else if ( ptr < end ) memcpy(&val,ptr,end-ptr);
+      return val; }
+
+    // squeezes the low nBits of each of the 8 bytes of vals into the low 8*nBits bits
+    static uint64_t pack8( uint64_t vals, unsigned nBits )
+    {
+#ifdef __BMI2__
+      return _pext_u64(vals,UNPACK_MASKS[nBits]);
+#else
+      uint64_t mask = (1ul << nBits) - 1ul;
+      uint64_t result = 0;
+      for ( unsigned idx = 0; idx != 8; ++idx, vals >>= 8 )
+          result |= (vals & mask) << nBits*idx;
+      return result;
+#endif
+    }
+
+    // spreads the low 8*nBits bits of vals, nBits at a time, into 8 bytes
+    static uint64_t unpack8( uint64_t vals, unsigned nBits )
+    {
+#ifdef __BMI2__
+      return _pdep_u64(vals,UNPACK_MASKS[nBits]);
+#else
+      uint64_t mask = (1ul << nBits) - 1ul;
+      uint64_t result = 0;
+      for ( unsigned idx = 0; idx != 8; ++idx, vals >>= nBits )
+          result |= (vals & mask) << 8*idx;
+      return result;
+#endif
+    }
+
+    struct Block
+    { Block( uint8_t nQs, uint8_t bits, uint8_t minQ )
+      : mNQs(nQs), mBits(bits), mMinQ(minQ) {}
+      unsigned size() const { return blockSize(mNQs,mBits); }
+      static unsigned blockSize( unsigned nQs, unsigned nBits )
+      { return (nQs*nBits+17+7)>>3; }
+      uint8_t mNQs; uint8_t mBits; uint8_t mMinQ; };
+
+    // how each qual string of a batch is to be packed:  its codec, and where
+    // its blocks start in mPlanBlocks
+    struct Plan
+    { Codec mCodec; size_t mFirstBlock; };
+
+    std::vector<Block> mBlocks;
+    std::vector<Plan> mPlans;
+    std::vector<Block> mPlanBlocks;
+    std::vector<unsigned> mCosts;
+    std::vector<Block> mLastBlocks;
+    std::vector<uint32_t> mMins;
+    std::vector<uint32_t> mMaxs;
+    std::vector<Block> mSavedBlocks;
+    std::vector<uint8_t> mResiduals;
+    std::vector<uint8_t> mRanks;
+    std::vector<uint8_t> mBuffer;
+    std::vector<uint8_t> mVals;
+    std::vector<char> mCoded[2];
+    RansCodec mRansCodec;
+    bool mFast;
+    bool mDelta;
+    bool mRans;
+    QualDict const* mpEncodeDict;
+    QualDict const* mpDecodeDict;
+    size_t mNEncoded;
+    Sample mSample;
+
+#ifdef __BMI2__
+    // for each bit width, the low nBits of each byte
+    static uint64_t const UNPACK_MASKS[8];
+#endif
+};
+
+#endif /* QUALCOMPRESSOR_H_ */
@@ -0,0 +1,94 @@
+/*
+ * QualDict.cc
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include "QualDict.h"
+#include <algorithm>
+#include <stdexcept>
+#include <stdlib.h>
+
+char const QualDict::TAG[] = "@CO\tOQCompress qual dictionary:";
+
+void QualDict::build( uint64_t const* counts )
+{
+    memset(mRanks,NONE,sizeof(mRanks));
+    mSize = 0;
+    for ( unsigned qual = 0; qual <= MAX_Q; ++qual )
+        if ( counts[qual] )
+        {
+            mRanks[qual] = mSize;
+            mQuals[mSize++] = qual;
+        }
+}
+
+// the quals, in order, separated by commas
+std::string QualDict::headerLine() const
+{
+    std::string line(TAG);
+    for ( unsigned rank = 0; rank != mSize; ++rank )
+    {
+        if ( rank )
+            line += ',';
+        line += std::to_string(unsigned(mQuals[rank]));
+    }
+    line += '\n';
+    return line;
+}
+
+bool QualDict::parseHeaderLine( char const* beg, char const* end )
+{
+    size_t tagLen = sizeof(TAG) - 1;
+    if ( size_t(end-beg) < tagLen || memcmp(beg,TAG,tagLen) )
+        return false; // EARLY RETURN!
+
+    memset(mRanks,NONE,sizeof(mRanks));
+    mSize = 0;
+    std::string vals(beg+tagLen,end);
+    char const* itr = vals.c_str();
+    while ( true )
+    {
+        char* next;
+        unsigned long qual = strtoul(itr,&next,10);
+        if ( next == itr || qual > MAX_Q || (mSize && qual <= mQuals[mSize-1]) ||
+                (*next && *next != ',') )
+            break;
+        mRanks[qual] = mSize;
+        mQuals[mSize++] = qual;
+        if ( !*next )
+            return true; // EARLY RETURN!
+        itr = next + 1;
+    }
+    throw std::runtime_error("The BAM header's qual dictionary is garbled.");
+}
+
+bool QualDict::extractFrom( std::string& text )
+{
+    for ( size_t beg = 0; beg < text.size(); )
+    {
+        size_t end = text.find('\n',beg);
+        if ( end == std::string::npos )
+            end = text.size();
+        // the text may be padded with NULs
+        char const* lineBeg = text.data() + beg;
+        size_t lineLen = strnlen(lineBeg,end-beg);
+        if ( parseHeaderLine(lineBeg,lineBeg+lineLen) )
+        {
+            text.erase(beg,std::min(end+1,text.size())-beg);
+            return true; // EARLY RETURN!
+        }
+        beg = end + 1;
+    }
+    return false;
+}
+
+// before any NUL padding, and on a line of its own
+void QualDict::insertInto( std::string& text ) const
+{
+    size_t end = strnlen(text.data(),text.size());
+    std::string line = headerLine();
+    if ( end && text[end-1] != '\n' )
+        line.insert(line.begin(),'\n');
+    text.insert(end,line);
+}
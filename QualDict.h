@@ -0,0 +1,58 @@
+/*
+ * QualDict.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef QUALDICT_H_
+#define QUALDICT_H_
+
+#include <string>
+#include <stdint.h>
+#include <string.h>
+
+// a dense ranking of the distinct quals in a file.  binned quals are sparse
+// (2, 12, 23, and 37, say), and their ranks pack into fewer bits.  it's kept
+// in the BAM header as an @CO line.
+class QualDict
+{
+public:
+    QualDict() : mSize(0) { memset(mRanks,NONE,sizeof(mRanks)); }
+
+    // ranks each qual (0..MAX_Q) with a non-zero count
+    void build( uint64_t const* counts );
+
+    bool empty() const { return !mSize; }
+    unsigned size() const { return mSize; }
+
+    // NONE if the qual isn't in the dictionary
+    uint8_t rank( unsigned qual ) const { return qual <= MAX_Q ? mRanks[qual] : NONE; }
+    uint8_t qual( unsigned rank ) const { return mQuals[rank]; }
+
+    // the header line, newline included
+    std::string headerLine() const;
+
+    // if the line from beg to end (less its newline) is a dictionary's header
+    // line, reads it and returns true.  throws std::runtime_error if it's a
+    // dictionary line that's garbled.
+    bool parseHeaderLine( char const* beg, char const* end );
+
+    // removes a dictionary's line from a BAM header's text, if there is one,
+    // and reads it.  returns false if there's none.
+    bool extractFrom( std::string& text );
+
+    // adds the dictionary's line to the end of a BAM header's text
+    void insertInto( std::string& text ) const;
+
+    static unsigned const MAX_Q = 63;
+    static uint8_t const NONE = 0xff;
+
+private:
+    uint8_t mRanks[MAX_Q+1];
+    uint8_t mQuals[MAX_Q+1];
+    unsigned mSize;
+
+    static char const TAG[];
+};
+
+#endif /* QUALDICT_H_ */
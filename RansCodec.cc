@@ -0,0 +1,306 @@
+/*
+ * RansCodec.cc
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include "RansCodec.h"
+#include <algorithm>
+#include <numeric>
+#include <string.h>
+
+void RansCodec::normalize( uint32_t const* counts, uint32_t total, Table& table )
+{
+    // each symbol that occurs gets at least 1, and the most common one absorbs
+    // the rounding error.  that can't take it below 1:  it has at least
+    // TOTAL/N_SYMS, and rounding the rare ones up adds less than N_SYMS.
+    table.mNSyms = 0;
+    unsigned biggest = 0;
+    uint32_t sum = 0;
+    for ( unsigned sym = 0; sym != N_SYMS; ++sym )
+    {
+        uint32_t freq = 0;
+        if ( counts[sym] )
+        {
+            freq = std::max(uint32_t(uint64_t(counts[sym])*TOTAL/total),1u);
+            if ( counts[sym] > counts[biggest] )
+                biggest = sym;
+            table.mSyms[table.mNSyms++] = sym;
+        }
+        table.mFreqs[sym] = freq;
+        sum += freq;
+    }
+    table.mFreqs[biggest] += TOTAL - sum;
+
+    uint32_t start = 0;
+    for ( unsigned sym = 0; sym != N_SYMS; ++sym )
+    {
+        table.mStarts[sym] = start;
+        start += table.mFreqs[sym];
+    }
+}
+
+// a symbol count, then each symbol and its varint frequency.  a table with a
+// single symbol leaves out its frequency, which must be TOTAL.
+void RansCodec::putTable( Table const& table, std::vector<char>& out )
+{
+    out.push_back(table.mNSyms);
+    for ( unsigned idx = 0; idx != table.mNSyms; ++idx )
+    {
+        unsigned sym = table.mSyms[idx];
+        out.push_back(sym);
+        if ( table.mNSyms > 1 )
+            putVarint(table.mFreqs[sym],out);
+    }
+}
+
+bool RansCodec::getTable( uint8_t const*& itr, uint8_t const* end, Table& table )
+{
+    if ( itr == end )
+        return false; // EARLY RETURN!
+    table.mNSyms = *itr++;
+    if ( !table.mNSyms || table.mNSyms > N_SYMS )
+        return false; // EARLY RETURN!
+    memset(table.mFreqs,0,sizeof(table.mFreqs));
+    uint32_t sum = 0;
+    for ( unsigned idx = 0; idx != table.mNSyms; ++idx )
+    {
+        if ( itr == end )
+            return false; // EARLY RETURN!
+        unsigned sym = *itr++;
+        if ( sym >= N_SYMS || (idx && sym <= table.mSyms[idx-1]) )
+            return false; // EARLY RETURN!
+        table.mSyms[idx] = sym;
+        uint32_t freq = TOTAL;
+        if ( table.mNSyms > 1 && (!getVarint(itr,end,freq) || !freq || freq >= TOTAL) )
+            return false; // EARLY RETURN!
+        table.mFreqs[sym] = freq;
+        sum += freq;
+    }
+    if ( sum != TOTAL )
+        return false; // EARLY RETURN!
+
+    uint32_t start = 0;
+    for ( unsigned sym = 0; sym != N_SYMS; ++sym )
+    {
+        table.mStarts[sym] = start;
+        start += table.mFreqs[sym];
+    }
+    for ( unsigned idx = 0; idx != table.mNSyms; ++idx )
+        table.mSymStarts[idx] = table.mStarts[table.mSyms[idx]];
+    return true;
+}
+
+void RansCodec::putVarint( uint32_t val, std::vector<char>& out )
+{
+    while ( val >= 0x80 )
+    {
+        out.push_back(val | 0x80);
+        val >>= 7;
+    }
+    out.push_back(val);
+}
+
+bool RansCodec::getVarint( uint8_t const*& itr, uint8_t const* end, uint32_t& val )
+{
+    val = 0;
+    for ( unsigned shift = 0; shift < 32; shift += 7 )
+    {
+        if ( itr == end )
+            return false; // EARLY RETURN!
+        uint8_t byte = *itr++;
+        val |= uint32_t(byte & 0x7f) << shift;
+        if ( !(byte & 0x80) )
+            return true; // EARLY RETURN!
+    }
+    return false;
+}
+
+void RansCodec::flush( uint32_t const* states, uint8_t*& ptr )
+{
+    for ( unsigned idx = N_STATES; idx-- > 0; )
+    {
+        ptr -= sizeof(uint32_t);
+        memcpy(ptr,&states[idx],sizeof(uint32_t));
+    }
+}
+
+bool RansCodec::isDone( uint32_t const* states, uint8_t const* itr, uint8_t const* end )
+{
+    for ( unsigned idx = 0; idx != N_STATES; ++idx )
+        if ( states[idx] != RANS_L )
+            return false; // EARLY RETURN!
+    return itr == end;
+}
+
+bool RansCodec::init( uint32_t* states, uint8_t const*& itr, uint8_t const* end )
+{
+    if ( size_t(end-itr) < N_STATES*sizeof(uint32_t) )
+        return false; // EARLY RETURN!
+    memcpy(states,itr,N_STATES*sizeof(uint32_t));
+    itr += N_STATES*sizeof(uint32_t);
+    return true;
+}
+
+// the symbols are coded last to first, so that they decode first to last.
+// the coded bytes are built backwards from the end of mBuf, which is big enough
+// for the states plus, at worst, 2 bytes a symbol.
+void RansCodec::encode0( uint8_t const* vals, unsigned n, std::vector<char>& out )
+{
+    uint32_t counts[N_SYMS] = {};
+    for ( unsigned idx = 0; idx != n; ++idx )
+        counts[vals[idx]] += 1;
+    mTables.resize(1);
+    Table& table = mTables[0];
+    normalize(counts,n,table);
+
+    mBuf.resize(2ul*n + N_STATES*sizeof(uint32_t));
+    uint8_t* end = mBuf.data() + mBuf.size();
+    uint8_t* ptr = end;
+    uint32_t states[N_STATES] = { RANS_L, RANS_L, RANS_L, RANS_L };
+    for ( unsigned idx = n; idx-- > 0; )
+        put(states[idx%N_STATES],ptr,table,vals[idx]);
+    flush(states,ptr);
+
+    putVarint(n,out);
+    putTable(table,out);
+    out.insert(out.end(),ptr,end);
+}
+
+bool RansCodec::decode0( uint8_t const* coded, unsigned len, unsigned nQuals,
+                            unsigned offset, std::vector<char>& out )
+{
+    uint8_t const* itr = coded;
+    uint8_t const* end = coded + len;
+    uint32_t n;
+    mTables.resize(1);
+    Table& table = mTables[0];
+    uint32_t states[N_STATES];
+    if ( !getVarint(itr,end,n) || n != nQuals )
+        return false; // EARLY RETURN!
+    // no quals have a table of no symbols, which getTable won't take
+    if ( !n )
+        return itr != end && !*itr++ && init(states,itr,end) && isDone(states,itr,end);
+    if ( !getTable(itr,end,table) || !init(states,itr,end) )
+        return false; // EARLY RETURN!
+    for ( unsigned idx = 0; idx != table.mNSyms; ++idx )
+    {
+        unsigned sym = table.mSyms[idx];
+        memset(mSlots+table.mStarts[sym],sym,table.mFreqs[sym]);
+    }
+
+    size_t outIdx = out.size();
+    out.resize(outIdx+n);
+    char* pOut = &out[outIdx];
+    unsigned idx = 0;
+    for ( ; idx + N_STATES <= n; idx += N_STATES )
+    {
+        // decode a symbol from each state before any of them renormalizes
+        unsigned syms[N_STATES];
+        for ( unsigned st = 0; st != N_STATES; ++st )
+            syms[st] = mSlots[states[st] & (TOTAL-1)];
+        for ( unsigned st = 0; st != N_STATES; ++st )
+        {
+            pOut[idx+st] = syms[st] + offset;
+            if ( !take(states[st],itr,end,table,syms[st]) )
+                return false; // EARLY RETURN!
+        }
+    }
+    for ( ; idx != n; ++idx )
+    {
+        uint32_t& state = states[idx%N_STATES];
+        unsigned sym = mSlots[state & (TOTAL-1)];
+        pOut[idx] = sym + offset;
+        if ( !take(state,itr,end,table,sym) )
+            return false; // EARLY RETURN!
+    }
+    return isDone(states,itr,end);
+}
+
+// each state codes a quarter of the vals, with the value before each one (or 0,
+// at the start of a quarter) as its context.  the tables are listed by context.
+void RansCodec::encode1( uint8_t const* vals, unsigned n, std::vector<char>& out )
+{
+    unsigned quarter = (n + N_STATES - 1) / N_STATES;
+    std::vector<uint32_t>& counts = mCounts;
+    counts.assign(N_SYMS*N_SYMS,0);
+    for ( unsigned idx = 0; idx != n; ++idx )
+        counts[(idx % quarter ? vals[idx-1] : 0)*N_SYMS + vals[idx]] += 1;
+
+    mTables.resize(N_SYMS);
+    putVarint(n,out);
+    size_t nCtxIdx = out.size();
+    out.push_back(0);
+    for ( unsigned ctx = 0; ctx != N_SYMS; ++ctx )
+    {
+        uint32_t const* ctxCounts = &counts[ctx*N_SYMS];
+        uint32_t total = std::accumulate(ctxCounts,ctxCounts+N_SYMS,0u);
+        if ( !total )
+            continue;
+        normalize(ctxCounts,total,mTables[ctx]);
+        out[nCtxIdx] += 1;
+        out.push_back(ctx);
+        putTable(mTables[ctx],out);
+    }
+
+    mBuf.resize(2ul*n + N_STATES*sizeof(uint32_t));
+    uint8_t* end = mBuf.data() + mBuf.size();
+    uint8_t* ptr = end;
+    uint32_t states[N_STATES] = { RANS_L, RANS_L, RANS_L, RANS_L };
+    for ( unsigned pos = quarter; pos-- > 0; )
+        for ( unsigned st = N_STATES; st-- > 0; )
+        {
+            unsigned idx = st*quarter + pos;
+            if ( idx < n )
+                put(states[st],ptr,mTables[pos ? vals[idx-1] : 0],vals[idx]);
+        }
+    flush(states,ptr);
+    out.insert(out.end(),ptr,end);
+}
+
+bool RansCodec::decode1( uint8_t const* coded, unsigned len, unsigned nQuals,
+                            unsigned offset, std::vector<char>& out )
+{
+    uint8_t const* itr = coded;
+    uint8_t const* end = coded + len;
+    uint32_t n;
+    if ( !getVarint(itr,end,n) || n != nQuals || itr == end )
+        return false; // EARLY RETURN!
+    unsigned nCtxs = *itr++;
+    mTables.resize(N_SYMS);
+    bool present[N_SYMS] = {};
+    while ( nCtxs-- )
+    {
+        if ( itr == end )
+            return false; // EARLY RETURN!
+        unsigned ctx = *itr++;
+        if ( ctx >= N_SYMS || present[ctx] || !getTable(itr,end,mTables[ctx]) )
+            return false; // EARLY RETURN!
+        present[ctx] = true;
+    }
+    uint32_t states[N_STATES];
+    if ( !init(states,itr,end) )
+        return false; // EARLY RETURN!
+
+    size_t outIdx = out.size();
+    out.resize(outIdx+n);
+    uint8_t* pOut = reinterpret_cast<uint8_t*>(&out[outIdx]);
+    unsigned quarter = (n + N_STATES - 1) / N_STATES;
+    uint8_t ctxs[N_STATES] = {};
+    for ( unsigned pos = 0; pos != quarter; ++pos )
+        for ( unsigned st = 0; st != N_STATES; ++st )
+        {
+            unsigned idx = st*quarter + pos;
+            if ( idx >= n )
+                break;
+            if ( !present[ctxs[st]] )
+                return false; // EARLY RETURN!
+            Table const& table = mTables[ctxs[st]];
+            unsigned sym = table.symbol(states[st] & (TOTAL-1));
+            pOut[idx] = sym + offset;
+            ctxs[st] = sym;
+            if ( !take(states[st],itr,end,table,sym) )
+                return false; // EARLY RETURN!
+        }
+    return isDone(states,itr,end);
+}
@@ -0,0 +1,99 @@
+/*
+ * RansCodec.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef RANSCODEC_H_
+#define RANSCODEC_H_
+
+#include <algorithm>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// order-0 and order-1 rANS coding of a string of quals, each of them 0..63.
+// a coded string is self-contained:  a varint count of quals, the normalized
+// symbol frequencies (one table for order-0, one per preceding qual for
+// order-1), the four coder states, and then the renormalization bytes.
+// four states are interleaved so that the decoder has four independent
+// dependency chains to work on.  for order-0, the states take turns qual by
+// qual.  for order-1, each codes a quarter of the string.
+class RansCodec
+{
+public:
+    RansCodec() {}
+    RansCodec( RansCodec const& )=delete;
+    RansCodec& operator=( RansCodec const& )=delete;
+
+    // these append the coded form of the n vals to out
+    void encode0( uint8_t const* vals, unsigned n, std::vector<char>& out );
+    void encode1( uint8_t const* vals, unsigned n, std::vector<char>& out );
+
+    // these append the decoded quals, plus offset, to out.  they return false
+    // if the len bytes at coded aren't a valid coded string of nQuals quals,
+    // which is checked before out's grown to hold them.
+    bool decode0( uint8_t const* coded, unsigned len, unsigned nQuals, unsigned offset,
+                    std::vector<char>& out );
+    bool decode1( uint8_t const* coded, unsigned len, unsigned nQuals, unsigned offset,
+                    std::vector<char>& out );
+
+    static unsigned const N_SYMS = 64;
+
+private:
+    static unsigned const SCALE_BITS = 12;
+    static uint32_t const TOTAL = 1u << SCALE_BITS;
+    static uint32_t const RANS_L = 1u << 23; // lower bound of a normalized state
+    static unsigned const N_STATES = 4;
+
+    // normalized frequencies and their cumulative starts, for one context.
+    // mSyms lists the symbols that occur, in increasing order, and mSymStarts
+    // their starts, which the decoder searches to find the symbol for a slot.
+    struct Table
+    { uint16_t mFreqs[N_SYMS]; uint16_t mStarts[N_SYMS];
+      uint8_t mSyms[N_SYMS]; uint16_t mSymStarts[N_SYMS]; unsigned mNSyms;
+      unsigned symbol( uint32_t slot ) const
+      { return mSyms[std::upper_bound(mSymStarts,mSymStarts+mNSyms,slot)-mSymStarts-1]; } };
+
+    // scales counts (which total to total) so that they total to TOTAL
+    static void normalize( uint32_t const* counts, uint32_t total, Table& table );
+
+    static void putTable( Table const& table, std::vector<char>& out );
+    static bool getTable( uint8_t const*& itr, uint8_t const* end, Table& table );
+
+    static void putVarint( uint32_t val, std::vector<char>& out );
+    static bool getVarint( uint8_t const*& itr, uint8_t const* end, uint32_t& val );
+
+    // pushes sym onto a state, spilling low bytes backwards from ptr
+    static void put( uint32_t& state, uint8_t*& ptr, Table const& table, unsigned sym )
+    { uint32_t freq = table.mFreqs[sym];
+      uint32_t xMax = ((RANS_L >> SCALE_BITS) << 8) * freq;
+      while ( state >= xMax )
+      { *--ptr = state; state >>= 8; }
+      state = (state/freq << SCALE_BITS) + state%freq + table.mStarts[sym]; }
+
+    // pops sym off a state, refilling it from itr.  returns false if it runs
+    // past end.
+    static bool take( uint32_t& state, uint8_t const*& itr, uint8_t const* end,
+                        Table const& table, unsigned sym )
+    { state = table.mFreqs[sym]*(state >> SCALE_BITS) + (state & (TOTAL-1)) - table.mStarts[sym];
+      while ( state < RANS_L )
+      { if ( itr == end ) return false;
+        state = state << 8 | *itr++; }
+      return true; }
+
+    // spills the final states in front of ptr, so the first state is first
+    static void flush( uint32_t const* states, uint8_t*& ptr );
+    static bool init( uint32_t* states, uint8_t const*& itr, uint8_t const* end );
+
+    // true if the states are back where the encoder started them, and all the
+    // bytes have been used:  a check that nothing was corrupted
+    static bool isDone( uint32_t const* states, uint8_t const* itr, uint8_t const* end );
+
+    std::vector<uint8_t> mBuf;
+    std::vector<uint32_t> mCounts;
+    std::vector<Table> mTables;
+    uint8_t mSlots[TOTAL]; // order-0 decoding:  the symbol for each slot
+};
+
+#endif /* RANSCODEC_H_ */
@@ -0,0 +1,75 @@
+/*
+ * Stats.cc
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include "Stats.h"
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+
+std::atomic<uint64_t> Stats::gCounts[Stats::N_COUNTERS];
+std::atomic<uint64_t> Stats::gNanos[Stats::N_STAGES];
+Stats::Clock::time_point Stats::gStart;
+bool Stats::gEnabled = false;
+
+std::string Stats::json( bool final )
+{
+    static char const* const COUNTER_NAMES[N_COUNTERS] =
+    { "records", "bases", "oqTags", "oqBytesIn", "zqBytesOut", "zqTags", "zqBytesIn",
+      "oqBytesOut", "blocksRead", "bytesRead", "blocksWritten", "bytesWritten",
+      "storedFallbacks", "deltaTags", "ransTags",
+      "dictTags", "blocksCopied" };
+    static char const* const STAGE_NAMES[N_STAGES] =
+    { "read", "inflate", "parse", "configureBlocks", "encode", "decode", "assemble",
+      "deflate", "write" };
+
+    std::ostringstream os;
+    os << "{\"final\":" << (final ? "true" : "false") << ",\"elapsedSeconds\":"
+       << std::chrono::duration<double>(Clock::now()-gStart).count() << ",\"counters\":{";
+    for ( int idx = 0; idx != N_COUNTERS; ++idx )
+        os << (idx ? "," : "") << '"' << COUNTER_NAMES[idx] << "\":" << gCounts[idx].load();
+    os << "},\"stageSeconds\":{";
+    for ( int idx = 0; idx != N_STAGES; ++idx )
+        os << (idx ? "," : "") << '"' << STAGE_NAMES[idx] << "\":" << gNanos[idx].load()/1e9;
+    os << "}}";
+    return os.str();
+}
+
+StatsReporter::StatsReporter( char const* file, unsigned interval )
+: mOS(file), mFile(file), mInterval(interval), mDone(false)
+{
+    if ( !mOS )
+    {
+        std::cerr << "Can't write stats file " << file << std::endl;
+        exit(1);
+    }
+    Stats::enable();
+    if ( mInterval )
+        mThread = std::thread([this]
+        { std::unique_lock<std::mutex> lock(mMutex);
+          while ( !mCV.wait_for(lock,std::chrono::seconds(mInterval),[this]{ return mDone; }) )
+              write(false); });
+}
+
+StatsReporter::~StatsReporter()
+{
+    if ( mThread.joinable() )
+    {
+        { std::lock_guard<std::mutex> lock(mMutex);
+          mDone = true; }
+        mCV.notify_one();
+        mThread.join();
+    }
+    write(true);
+}
+
+void StatsReporter::write( bool final )
+{
+    if ( !(mOS << Stats::json(final) << std::endl) )
+    {
+        std::cerr << "Can't write stats file " << mFile << std::endl;
+        exit(1);
+    }
+}
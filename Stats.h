@@ -0,0 +1,101 @@
+/*
+ * Stats.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <stdint.h>
+
+// process-wide counters, and timers for each stage of a conversion, for --stats.
+// the stage times are summed over all threads, so they can add up to more than
+// the elapsed time.  counters are cheap, but should still be bumped in bulk (a
+// block or a batch at a time) rather than per byte.  timers only run once
+// stats are enabled.
+class Stats
+{
+public:
+    enum Counter
+    { RECORDS, BASES, OQ_TAGS, OQ_BYTES_IN, ZQ_BYTES_OUT, ZQ_TAGS, ZQ_BYTES_IN,
+      OQ_BYTES_OUT, BLOCKS_READ, BYTES_READ, BLOCKS_WRITTEN, BYTES_WRITTEN,
+      STORED_FALLBACKS, DELTA_TAGS, RANS_TAGS, DICT_TAGS, BLOCKS_COPIED,
+      N_COUNTERS };
+
+    enum Stage
+    { READ, INFLATE, PARSE, CONFIGURE_BLOCKS, ENCODE, DECODE, ASSEMBLE, DEFLATE,
+      WRITE, N_STAGES };
+
+    typedef std::chrono::steady_clock Clock;
+
+    static void count( Counter counter, uint64_t val )
+    { gCounts[counter].fetch_add(val,std::memory_order_relaxed); }
+
+    static void addTime( Stage stage, Clock::duration time )
+    { gNanos[stage].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count(),
+                                std::memory_order_relaxed); }
+
+    static void enable()
+    { gStart = Clock::now(); gEnabled = true; }
+
+    static bool isEnabled() { return gEnabled; }
+
+    // a snapshot of everything as a one-line JSON object
+    static std::string json( bool final );
+
+    // adds the time between its construction and destruction to a stage
+    class Timer
+    {
+    public:
+        explicit Timer( Stage stage ) : mStage(stage), mOn(gEnabled)
+        { if ( mOn ) mStart = Clock::now(); }
+        Timer( Timer const& )=delete;
+        Timer& operator=( Timer const& )=delete;
+        ~Timer()
+        { if ( mOn ) addTime(mStage,Clock::now()-mStart); }
+
+    private:
+        Stage mStage;
+        bool mOn;
+        Clock::time_point mStart;
+    };
+
+private:
+    static std::atomic<uint64_t> gCounts[N_COUNTERS];
+    static std::atomic<uint64_t> gNanos[N_STAGES];
+    static Clock::time_point gStart;
+    static bool gEnabled;
+};
+
+// enables stats, and writes a JSON snapshot of them to a file every interval
+// seconds (or never, if interval is 0), one per line, and a final one when
+// it's destroyed.
+class StatsReporter
+{
+public:
+    StatsReporter( char const* file, unsigned interval );
+    StatsReporter( StatsReporter const& )=delete;
+    StatsReporter& operator=( StatsReporter const& )=delete;
+    ~StatsReporter();
+
+private:
+    void write( bool final );
+
+    std::ofstream mOS;
+    char const* mFile;
+    unsigned mInterval;
+    bool mDone;
+    std::mutex mMutex;
+    std::condition_variable mCV;
+    std::thread mThread;
+};
+
+#endif /* STATS_H_ */
@@ -0,0 +1,127 @@
+/*
+ * ThreadPool.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// a fixed-size pool of worker threads that run submitted tasks in FIFO order.
+// a pool with no threads runs each task on the submitting thread, so callers
+// needn't have a separate code path for the single-threaded case.
+class ThreadPool
+{
+public:
+    explicit ThreadPool( unsigned nThreads )
+    : mStopping(false)
+    { mThreads.reserve(nThreads);
+      while ( nThreads-- )
+          mThreads.emplace_back(&ThreadPool::work,this); }
+
+    ThreadPool( ThreadPool const& )=delete;
+    ThreadPool& operator=( ThreadPool const& )=delete;
+
+    // queued tasks are finished before the threads are joined
+    ~ThreadPool()
+    { { std::lock_guard<std::mutex> lock(mMutex); mStopping = true; }
+      mCV.notify_all();
+      for ( std::thread& thread : mThreads )
+          thread.join(); }
+
+    unsigned size() const { return mThreads.size(); }
+
+    template <class F>
+    std::future<typename std::result_of<F()>::type> submit( F fn )
+    { typedef typename std::result_of<F()>::type Result;
+      std::shared_ptr<std::packaged_task<Result()>> pTask =
+              std::make_shared<std::packaged_task<Result()>>(std::move(fn));
+      std::future<Result> result = pTask->get_future();
+      if ( mThreads.empty() )
+          (*pTask)();
+      else
+      { { std::lock_guard<std::mutex> lock(mMutex);
+          mTasks.emplace_back([pTask]{ (*pTask)(); }); }
+        mCV.notify_one(); }
+      return result; }
+
+private:
+    void work()
+    { std::unique_lock<std::mutex> lock(mMutex);
+      while ( true )
+      { mCV.wait(lock,[this]{ return mStopping || !mTasks.empty(); });
+        if ( mTasks.empty() )
+            break;
+        std::function<void()> task = std::move(mTasks.front());
+        mTasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock(); } }
+
+    std::vector<std::thread> mThreads;
+    std::deque<std::function<void()>> mTasks;
+    std::mutex mMutex;
+    std::condition_variable mCV;
+    bool mStopping;
+};
+
+// a FIFO queue with a fixed capacity for handing work from one thread to another.
+// push blocks while the queue is full, and pop blocks while it's empty.
+template <class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue( size_t capacity )
+    : mCapacity(capacity), mClosed(false) {}
+
+    BoundedQueue( BoundedQueue const& )=delete;
+    BoundedQueue& operator=( BoundedQueue const& )=delete;
+
+    // returns false, without pushing, once the queue is closed
+    bool push( T val )
+    { { std::unique_lock<std::mutex> lock(mMutex);
+        mNotFull.wait(lock,[this]{ return mClosed || mQueue.size() < mCapacity; });
+        if ( mClosed )
+            return false;
+        mQueue.push_back(std::move(val)); }
+      mNotEmpty.notify_one();
+      return true; }
+
+    // returns false once the queue is closed and drained
+    bool pop( T& val )
+    { { std::unique_lock<std::mutex> lock(mMutex);
+        mNotEmpty.wait(lock,[this]{ return mClosed || !mQueue.empty(); });
+        if ( mQueue.empty() )
+            return false;
+        val = std::move(mQueue.front());
+        mQueue.pop_front(); }
+      mNotFull.notify_one();
+      return true; }
+
+    // no more pushes are allowed after closing.  pushers waiting for room
+    // give up, and poppers get what's left.
+    void close()
+    { { std::lock_guard<std::mutex> lock(mMutex); mClosed = true; }
+      mNotEmpty.notify_all();
+      mNotFull.notify_all(); }
+
+private:
+    std::deque<T> mQueue;
+    size_t mCapacity;
+    bool mClosed;
+    std::mutex mMutex;
+    std::condition_variable mNotFull;
+    std::condition_variable mNotEmpty;
+};
+
+#endif /* THREADPOOL_H_ */